@@ -1,14 +1,35 @@
 #ifndef INCLUDE_LUACPPMSG_HPP_
 #define INCLUDE_LUACPPMSG_HPP_
 
-#include <queue>
+#include <atomic>
+#include <chrono>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <vector>
 #include <unordered_map>
-#include <boost/smart_ptr/detail/spinlock.hpp>
 #include <boost/variant.hpp>
 #include <boost/optional.hpp>
 #include <boost/functional/hash.hpp>
+#include <boost/utility/string_view.hpp>
 #include <LuaContext.hpp>
+#include <LuaCppMsg/Batch.hpp>
+#include <LuaCppMsg/Blob.hpp>
+#include <LuaCppMsg/Dense.hpp>
+#include <LuaCppMsg/Lazy.hpp>
+#include <LuaCppMsg/Owned.hpp>
+#include <LuaCppMsg/Policy.hpp>
+#include <LuaCppMsg/ReadyFd.hpp>
+#include <LuaCppMsg/Scheduler.hpp>
+#include <LuaCppMsg/Schema.hpp>
+#include <LuaCppMsg/Signal.hpp>
+#include <LuaCppMsg/Tape.hpp>
 #include <iostream>
 
 namespace LuaCppMsg
@@ -19,34 +40,44 @@ namespace LuaCppMsg
  *
  * Provides utility helper methods for extracting values.
  *
+ * @tparam Policy compile-time options, e.g. the `Map` container (see `DefaultPolicy`).
  * @tparam CustomTypes list of additional types in the variant map/table. Must already be bound
  * to Lua.
  */
-template <class... CustomTypes>
-class Message
+template <class Policy, class... CustomTypes>
+class BasicMessage
 {
 public:
 	/// The type returned when the queue is popped in C++ - allows for `nil` to be represented.
-	using Opt = boost::optional<Message>;
+	using Opt = boost::optional<BasicMessage>;
 	/// Integer type (key).
 	using Int = int;
 	/// String type (key + value).
 	using Str = std::string;
 	/// Key type for maps/tables.
 	using Key = boost::variant<Int, Str>;
-	/// Variant type, which can be a message on its own, or combined in (recursive) `Map`s.
+	/// Variant type, which can be a message on its own, or combined in (recursive) `Map`s and
+	/// `Vec`s.
 	using Item = typename boost::make_recursive_variant
 	<
 		CustomTypes...,
 		Str,
-		std::unordered_map<
-			Key,
-			boost::recursive_variant_,
-			boost::hash<Key>
-		>
+		typename Policy::template Map<Key, boost::recursive_variant_>,
+		std::vector<boost::recursive_variant_>,
+		LuaCppMsg::Dense,
+		LuaCppMsg::Blob,
+		LuaCppMsg::Tape
 	>::type;
 	/// A map containing `Item`s (including other `Map`s).
-	using Map = std::unordered_map<Key, Item, boost::hash<Key>>;
+	using Map = typename Policy::template Map<Key, Item>;
+	/// A contiguous array of `Item`s, mapped to and from Lua sequences.
+	using Vec = std::vector<Item>;
+	/// A reference-counted array of numbers, shared with Lua as a userdata.
+	using Dense = LuaCppMsg::Dense;
+	/// A reference-counted buffer of bytes, shared with Lua as a userdata.
+	using Blob = LuaCppMsg::Blob;
+	/// A message serialised for a single-pass conversion to Lua.
+	using Tape = LuaCppMsg::Tape;
 
 	/**
 	 * Transient utility class providing accessors to nested data within recursive unordered_maps
@@ -74,16 +105,14 @@ public:
 		}
 
 		/**
-		 * Navigate to a value in the current branch of the Map.
+		 * Navigate to a value in the current branch of the Map or Vec.
 		 *
-		 * @param key_ variant key into Map.
+		 * @param key_ variant key into Map, or 1-based `Int` index into Vec.
 		 * @return a new Nested representing the Item referenced at `key_`.
 		 */
 		Nested get(const Key& key_) const
 		{
-			const Map& map = boost::get<Map>(*m_pitem);
-			const Item& item = map.at(key_);
-			return Nested(&item);
+			return Nested(&child(*m_pitem, key_));
 		}
 
 		/**
@@ -94,7 +123,40 @@ public:
 		 */
 		Nested get(const char* key_) const
 		{
-			return get(Str(key_));
+			return Nested(&child(*m_pitem, boost::string_view(key_)));
+		}
+
+		/**
+		 * Navigate to a value in the current branch of the Map.
+		 *
+		 * @param key_ string key into Map.
+		 * @return a new Nested representing the Item referenced at `key_`.
+		 */
+		Nested get(const Str& key_) const
+		{
+			return Nested(&child(*m_pitem, boost::string_view(key_)));
+		}
+
+		/**
+		 * Navigate to a value in the current branch of the Map, without copying the key.
+		 *
+		 * @param key_ string key into Map.
+		 * @return a new Nested representing the Item referenced at `key_`.
+		 */
+		Nested get(boost::string_view key_) const
+		{
+			return Nested(&child(*m_pitem, key_));
+		}
+
+		/**
+		 * Navigate to a value in the current branch of the Map or Vec.
+		 *
+		 * @param key_ integer key into Map, or 1-based index into Vec.
+		 * @return a new Nested representing the Item referenced at `key_`.
+		 */
+		Nested get(Int key_) const
+		{
+			return Nested(&child(*m_pitem, key_));
 		}
 
 		/**
@@ -117,21 +179,21 @@ public:
 	 *
 	 * @param item_ string of message.
 	 */
-	Message(const char* item_) : m_item(Item(Message::Str(item_))) {}
+	BasicMessage(const char* item_) : m_item(Item(Str(item_))) {}
 
 	/**
 	 * Construct a message from given Item, either for creation or when popped from the queue.
 	 *
 	 * @param item_ message item.
 	 */
-	Message(Item&& item_) : m_item(item_) {}
+	BasicMessage(Item&& item_) : m_item(std::move(item_)) {}
 
 	/**
 	 * Construct a message from given Item, either for creation or when popped from the queue.
 	 *
 	 * @param item_ message item.
 	 */
-	Message(const Item& item_) : m_item(item_) {}
+	BasicMessage(const Item& item_) : m_item(item_) {}
 
 	/**
 	 * Get reference to the Item at the root of this message.
@@ -164,16 +226,14 @@ public:
 	}
 
 	/**
-	 * Navigate to a value in the root Map.
+	 * Navigate to a value in the root Map or Vec.
 	 *
-	 * @param key_ variant key into Map.
+	 * @param key_ variant key into Map, or 1-based `Int` index into Vec.
 	 * @return a new Nested representing the Item referenced at `key_`.
 	 */
 	Nested get(const Key& key_) const
 	{
-		const Map& map = boost::get<Map>(m_item);
-		const Item& item = map.at(key_);
-		return Nested(&item);
+		return Nested(&child(m_item, key_));
 	}
 
 	/**
@@ -184,15 +244,143 @@ public:
 	 */
 	Nested get(const char* key_) const
 	{
-		return get(Str(key_));
+		return Nested(&child(m_item, boost::string_view(key_)));
+	}
+
+	/**
+	 * Navigate to a value in the root Map.
+	 *
+	 * @param key_ string key into Map.
+	 * @return a new Nested representing the Item referenced at `key_`.
+	 */
+	Nested get(const Str& key_) const
+	{
+		return Nested(&child(m_item, boost::string_view(key_)));
+	}
+
+	/**
+	 * Navigate to a value in the root Map, without copying the key.
+	 *
+	 * @param key_ string key into Map.
+	 * @return a new Nested representing the Item referenced at `key_`.
+	 */
+	Nested get(boost::string_view key_) const
+	{
+		return Nested(&child(m_item, key_));
+	}
+
+	/**
+	 * Navigate to a value in the root Map or Vec.
+	 *
+	 * @param key_ integer key into Map, or 1-based index into Vec.
+	 * @return a new Nested representing the Item referenced at `key_`.
+	 */
+	Nested get(Int key_) const
+	{
+		return Nested(&child(m_item, key_));
+	}
+
+	/**
+	 * Look up a value in a Map or Vec, without throwing if it isn't there.
+	 *
+	 * @param parent_ item to look in.
+	 * @param key_ `Key`, `Int` or `boost::string_view` key into Map, or 1-based `Int` index into
+	 * Vec, as in Lua.
+	 * @return pointer to the Item referenced at `key_`, or `nullptr` if `parent_` is neither a Map
+	 * nor a Vec, or has no such entry.
+	 */
+	template <class TKey>
+	static const Item* find(const Item& parent_, const TKey& key_)
+	{
+		if (const Vec* vec = boost::get<Vec>(&parent_))
+		{
+			const Int idx = index_or_zero(key_);
+			return idx >= 1 && std::size_t(idx) <= vec->size() ? &(*vec)[idx - 1] : nullptr;
+		}
+		if (const Map* map = boost::get<Map>(&parent_))
+		{
+			const auto it = find_in(*map, key_, IsTransparent<Map>{});
+			return it != map->end() ? &it->second : nullptr;
+		}
+		return nullptr;
 	}
 
 private:
 	/// Item at root of this message.
 	Item m_item;
+
+	/// Whether a map type can look up keys of other types, i.e. has a transparent comparator.
+	template <class TMap, class = void>
+	struct IsTransparent : std::false_type {};
+
+	template <class TMap>
+	struct IsTransparent<TMap, decltype(
+		std::declval<typename TMap::key_compare::is_transparent*>(), void()
+	)> : std::true_type {};
+
+	/**
+	 * Look up a value in a Map or Vec.
+	 *
+	 * Keys other than `Key` are only converted to a `Key` if the Map can't compare them directly.
+	 *
+	 * @param parent_ Map or Vec to look in.
+	 * @param key_ `Key`, `Int` or `boost::string_view` key into Map, or 1-based `Int` index into
+	 * Vec, as in Lua.
+	 * @return the Item referenced at `key_`.
+	 */
+	template <class TKey>
+	static const Item& child(const Item& parent_, const TKey& key_)
+	{
+		if (const Vec* vec = boost::get<Vec>(&parent_))
+			return vec->at(index_of(key_) - 1);
+
+		const Map& map = boost::get<Map>(parent_);
+		const auto it = find_in(map, key_, IsTransparent<Map>{});
+		if (it == map.end())
+			throw std::out_of_range("key not found in Map");
+		return it->second;
+	}
+
+	template <class TKey>
+	static typename Map::const_iterator find_in(const Map& map_, const TKey& key_, std::true_type)
+	{
+		return map_.find(key_);
+	}
+
+	template <class TKey>
+	static typename Map::const_iterator find_in(const Map& map_, const TKey& key_, std::false_type)
+	{
+		return map_.find(to_key(key_));
+	}
+
+	static const Key& to_key(const Key& key_) { return key_; }
+	static Key to_key(Int key_) { return Key(key_); }
+	static Key to_key(boost::string_view key_) { return Key(Str(key_.data(), key_.size())); }
+
+	static Int index_of(const Key& key_) { return boost::get<Int>(key_); }
+	static Int index_of(Int key_) { return key_; }
+	static Int index_of(boost::string_view) { throw boost::bad_get(); }
+
+	static Int index_or_zero(const Key& key_)
+	{
+		const Int* idx = boost::get<Int>(&key_);
+		return idx ? *idx : 0;
+	}
+
+	static Int index_or_zero(Int key_) { return key_; }
+	static Int index_or_zero(boost::string_view) { return 0; }
 };
 
 
+/**
+ * Wrapper class around the messages stored within the queue, using the default policy.
+ *
+ * @tparam CustomTypes list of additional types in the variant map/table.
+ */
+template <class... CustomTypes>
+using Message = BasicMessage<DefaultPolicy, CustomTypes...>;
+
+
 /**
  * Wrapper for pointer types that are unsafe.
  *
@@ -229,13 +417,16 @@ public:
 
 /**
  * Thread-safe C++/Lua queue of `Message`s.
+ *
+ * @tparam Policy compile-time options, e.g. the storage backend (see `DefaultPolicy`).
+ * @tparam CustomTypes list of additional types in the variant map/table.
  */
-template <class... CustomTypes>
-class Queue
+template <class Policy, class... CustomTypes>
+class BasicQueue
 {
 public:
-	using QueueType = Queue<CustomTypes...>;
-	using Msg = typename  LuaCppMsg::Message<CustomTypes...>;
+	using QueueType = BasicQueue<Policy, CustomTypes...>;
+	using Msg = LuaCppMsg::BasicMessage<Policy, CustomTypes...>;
 	using Opt = typename Msg::Opt;
 	/// Integer type (key).
 	using Int = typename Msg::Int;
@@ -247,8 +438,28 @@ public:
 	using Item = typename Msg::Item;
 	/// An map containing `Item`s (including other `Map`s).
 	using Map = typename Msg::Map;
-	/// Internal queue type for storage of `Item`s.
-	using InternalQueue = std::queue<Item>;
+	/// A contiguous array of `Item`s, mapped to and from Lua sequences.
+	using Vec = typename Msg::Vec;
+	/// A reference-counted array of numbers, shared with Lua as a userdata.
+	using Dense = LuaCppMsg::Dense;
+	/// A reference-counted buffer of bytes, shared with Lua as a userdata.
+	using Blob = LuaCppMsg::Blob;
+	/// A message serialised for a single-pass conversion to Lua.
+	using Tape = LuaCppMsg::Tape;
+	/// Clock timestamping pushed messages, or `void` if the policy keeps no latencies.
+	using Clock = typename Policy::Clock;
+	/// Element stored: an `Item`, with the time it was pushed if the policy keeps latencies.
+	using Entry = typename std::conditional<
+		std::is_void<Clock>::value, Item, Stamped<Item>
+	>::type;
+	/// Histogram of push-to-pop latencies, `NoLatency` unless the policy keeps them.
+	using Histogram = typename std::conditional<
+		std::is_void<Clock>::value, NoLatency, LatencyHistogram
+	>::type;
+	/// Internal storage type for `Entry`s.
+	using InternalQueue = typename Policy::template Storage<Entry>;
+	/// Runtime statistics kept, `NoStats` unless the policy selects them.
+	using Stats = typename Policy::Stats;
 
 	/// Smart pointer to "luawrapper" `LuaContext`.
 	using Lua = std::shared_ptr<LuaContext>;
@@ -258,7 +469,7 @@ public:
 	 *
 	 * To use with lua, Queue::bind and Queue::to_lua will have to be called separately.
 	 */
-	Queue() = default;
+	BasicQueue() = default;
 
 	/**
 	 * Construct and bind to given Lua state.
@@ -267,7 +478,7 @@ public:
 	 *
 	 * @param plua Lua state to bind to.
 	 */
-	Queue (lua_State* plua)
+	BasicQueue (lua_State* plua)
 	{
 		bind(plua);
 	}
@@ -278,24 +489,85 @@ public:
 	 * @param plua Lua state to bind to.
 	 * @param lua_name name of variable in global Lua namespace.
 	 */
-	Queue (lua_State* plua, const std::string& lua_name)
+	BasicQueue (lua_State* plua, const std::string& lua_name)
 	{
 		bind(plua);
 		to_lua(lua_name);
 	}
 
 	/**
-	 * Trivial destructor.
+	 * Destructor, closing the readiness descriptor if one was created.
 	 */
-	~Queue () {}
+	~BasicQueue ()
+	{
+		delete m_ready.load();
+	}
 
 	/**
 	 * Thread-safely get size of queue.
 	 */
 	unsigned size ()
 	{
-		std::lock_guard<boost::detail::spinlock> lock(m_lock);
-		return size_unsafe();
+		return m_queue.size();
+	}
+
+	/**
+	 * Thread-safely get a snapshot of the queue's runtime statistics, or just its depth if the
+	 * policy doesn't keep them (see `StatsPolicy`).
+	 *
+	 * Counters are read individually, so may be slightly inconsistent with one another while
+	 * the queue is in use.  When statistics are kept the depth is worked out from the push and
+	 * pop counts rather than the storage, so reading them doesn't take the lock they count.
+	 * Exposed to Lua as `lqueue:stats()`, returning a table of them.
+	 */
+	QueueStats stats ()
+	{
+		QueueStats stats;
+		if (!Stats::enabled)
+			stats.depth = m_queue.size();
+		m_stats.read(stats);
+		read_lock_stats(m_queue, stats);
+		return stats;
+	}
+
+	/**
+	 * Get the histogram of latencies from push to pop, if the policy keeps them (see
+	 * `LatencyPolicy`).
+	 *
+	 * Exposed to Lua as `lqueue:latency(percent)`, getting a percentile in nanoseconds, and
+	 * `lqueue:reset_latency()`.
+	 *
+	 * @return the histogram, which may be queried and reset while the queue is in use.
+	 */
+	Histogram& latency ()
+	{
+		return m_latency;
+	}
+
+	/**
+	 * Get a file descriptor that is readable while the queue has messages, creating it on first
+	 * call, so an event loop can sleep until messages arrive.
+	 *
+	 * Producers only write to it when the queue goes from empty to non-empty, so a burst costs a
+	 * single write, and pops clear it once they leave the queue empty.  It may occasionally be
+	 * readable with the queue empty; the next pop then finds nothing and clears it.  Don't read
+	 * from it directly.  Exposed to Lua as `lqueue:ready_fd()`.
+	 *
+	 * @return descriptor to poll for readability, owned by the queue.
+	 * @throws std::system_error if it can't be created.
+	 */
+	int ready_fd ()
+	{
+		ReadyFd* ready = m_ready.load();
+		if (!ready)
+		{
+			std::unique_ptr<ReadyFd> created(new ReadyFd());
+			if (m_ready.compare_exchange_strong(ready, created.get()))
+				ready = created.release();
+			if (m_queue.size())
+				ready->signal();
+		}
+		return ready->fd();
 	}
 
 	/**
@@ -305,8 +577,7 @@ public:
 	 */
 	void push (const char* msg_)
 	{
-		std::lock_guard<boost::detail::spinlock> lock(m_lock);
-		m_queue.push(Item(Str(msg_)));
+		push_item(Item(Str(msg_)));
 	}
 
 	/**
@@ -316,9 +587,15 @@ public:
 	 */
 	void push (const Item& msg_)
 	{
-		std::lock_guard<boost::detail::spinlock> lock(m_lock);
-		Item item = boost::apply_visitor(CopyVisitor(), msg_);
-		m_queue.push(std::move(item));
+		Tape tape;
+		if (serialise(msg_, tape))
+		{
+			push_item(Item(std::move(tape)));
+			return;
+		}
+		Item item(msg_);
+		copy_ptrs(item);
+		push_item(std::move(item));
 	}
 
 	/**
@@ -328,9 +605,76 @@ public:
 	 */
 	void push (Item&& msg_)
 	{
-		std::lock_guard<boost::detail::spinlock> lock(m_lock);
-		Item item = boost::apply_visitor(CopyVisitor(), msg_);
-		m_queue.push(std::move(item));
+		prepare(msg_);
+		push_item(std::move(msg_));
+	}
+
+	/**
+	 * Thread-safely push an Item in C++, unless the queue is at capacity.
+	 *
+	 * @param msg_ message to append to queue.
+	 * @return whether the message was appended.
+	 */
+	bool try_push (const Item& msg_)
+	{
+		Tape tape;
+		if (serialise(msg_, tape))
+		{
+			Item item(std::move(tape));
+			return try_push_item(item);
+		}
+		Item item(msg_);
+		copy_ptrs(item);
+		return try_push_item(item);
+	}
+
+	/**
+	 * Thread-safely push an Item in C++, unless the queue is at capacity.
+	 *
+	 * @param msg_ message to append to queue.
+	 * @return whether the message was appended.
+	 */
+	bool try_push (Item&& msg_)
+	{
+		prepare(msg_);
+		return try_push_item(msg_);
+	}
+
+	/**
+	 * Thread-safely push an Item in C++, waiting up to `timeout_` for space if the queue is at
+	 * capacity.
+	 *
+	 * @param msg_ message to append to queue.
+	 * @param timeout_ maximum time to wait for space.
+	 * @return whether the message was appended before the timeout expired.
+	 */
+	template <class Rep, class Period>
+	bool push_for (const Item& msg_, const std::chrono::duration<Rep, Period>& timeout_)
+	{
+		Tape tape;
+		if (serialise(msg_, tape))
+		{
+			Item item(std::move(tape));
+			return push_item_for(item, timeout_);
+		}
+		Item item(msg_);
+		copy_ptrs(item);
+		return push_item_for(item, timeout_);
+	}
+
+	/**
+	 * Thread-safely push an Item in C++, waiting up to `timeout_` for space if the queue is at
+	 * capacity.
+	 *
+	 * @param msg_ message to append to queue.
+	 * @param timeout_ maximum time to wait for space.
+	 * @return whether the message was appended before the timeout expired.
+	 */
+	template <class Rep, class Period>
+	bool push_for (Item&& msg_, const std::chrono::duration<Rep, Period>& timeout_)
+	{
+		prepare(msg_);
+		return push_item_for(msg_, timeout_);
 	}
 
 	/**
@@ -340,14 +684,145 @@ public:
 	 */
 	Opt pop ()
 	{
-		std::lock_guard<boost::detail::spinlock> lock(m_lock);
-
-		if (!size_unsafe())
+		boost::optional<Item> item = pop_item();
+		if (!item)
 			return boost::none;
+		unpack(*item);
+		return Msg(std::move(*item));
+	}
+
+	/**
+	 * Thread-safely pop a Message in C++, sleeping until one is available if the queue is empty.
+	 *
+	 * @return the popped Message.
+	 */
+	Msg pop_wait ()
+	{
+		boost::optional<Item> item = pop_item();
+		if (!item)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			m_items.wait([this, &item]() { return bool(item = pop_item()); });
+			m_stats.on_pop_wait(elapsed_ns(start));
+			pass_items_signal();
+		}
+		unpack(*item);
+		return Msg(std::move(*item));
+	}
+
+	/**
+	 * Thread-safely pop a Message in C++, sleeping up to `timeout_` for one to become available
+	 * if the queue is empty.
+	 *
+	 * @param timeout_ maximum time to wait for a message.
+	 * @return an `optional` that either contains a Message, or is falsey if the timeout expired.
+	 */
+	template <class Rep, class Period>
+	Opt pop_for (const std::chrono::duration<Rep, Period>& timeout_)
+	{
+		boost::optional<Item> item = pop_item();
+		if (!item)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			const bool waited =
+				m_items.wait_for([this, &item]() { return bool(item = pop_item()); }, timeout_);
+			m_stats.on_pop_wait(elapsed_ns(start));
+			if (!waited)
+				return boost::none;
+			pass_items_signal();
+		}
+		unpack(*item);
+		return Msg(std::move(*item));
+	}
+
+	/**
+	 * Thread-safely push a range of Items in C++, under a single lock acquisition where possible.
+	 *
+	 * Waits for space if the queue is at capacity.  Use `std::make_move_iterator` to move rather
+	 * than copy the elements.
+	 *
+	 * @param first_ iterator to first message to append.
+	 * @param last_ iterator past last message to append.
+	 */
+	template <class It>
+	void push_bulk (It first_, It last_)
+	{
+		std::vector<Item> items;
+		for (; first_ != last_; ++first_)
+			items.emplace_back(*first_);
+		push_bulk(std::move(items));
+	}
+
+	/**
+	 * Thread-safely push a batch of Items in C++, under a single lock acquisition where possible.
+	 *
+	 * Waits for space if the queue is at capacity.
+	 *
+	 * @param msgs_ messages to append.
+	 */
+	void push_bulk (std::vector<Item>&& msgs_)
+	{
+		for (Item& msg : msgs_)
+			prepare(msg);
+		push_items(msgs_.begin(), msgs_.end());
+	}
+
+	/**
+	 * Thread-safely pop up to `max_` Messages in C++, under a single lock acquisition where
+	 * possible.
+	 *
+	 * @param max_ maximum number of messages to pop.
+	 * @return the popped messages, in order.
+	 */
+	std::vector<Msg> pop_bulk (std::size_t max_)
+	{
+		std::vector<Msg> msgs;
+		msgs.reserve(std::min<std::size_t>(max_, m_queue.size()));
+		pop_items(std::back_inserter(msgs), max_);
+		for (Msg& msg : msgs)
+			unpack(msg.item());
+		return msgs;
+	}
+
+	/**
+	 * Thread-safely pop all available Messages in C++, under a single lock acquisition where
+	 * possible.
+	 *
+	 * @param msgs_ vector to append the popped messages to, in order.
+	 * @return number of messages popped.
+	 */
+	std::size_t drain_into (std::vector<Msg>& msgs_)
+	{
+		const std::size_t first = msgs_.size();
+		msgs_.reserve(first + m_queue.size());
+		const std::size_t num =
+			pop_items(std::back_inserter(msgs_), std::numeric_limits<std::size_t>::max());
+		for (std::size_t i = first; i < msgs_.size(); i++)
+			unpack(msgs_[i].item());
+		return num;
+	}
 
-		Msg msg(std::move(m_queue.front()));
-		m_queue.pop();
-		return msg;
+	/**
+	 * Get maximum number of messages the queue will hold before `push` blocks and `try_push`
+	 * fails.
+	 *
+	 * @return capacity, or 0 if unbounded.
+	 */
+	std::size_t capacity () const
+	{
+		return m_queue.capacity();
+	}
+
+	/**
+	 * Set maximum number of messages the queue will hold before `push` blocks and `try_push`
+	 * fails.
+	 *
+	 * @param capacity_ new capacity, or 0 for the storage backend's maximum.
+	 */
+	void set_capacity (std::size_t capacity_)
+	{
+		m_queue.set_capacity(capacity_);
+		m_space.notify_all();
 	}
 
 	/**
@@ -363,28 +838,121 @@ public:
 	/**
 	 * Thread-safely push a message in Lua.
 	 *
+	 * Blocks if the queue is at capacity, so should be avoided on bounded queues that are only
+	 * consumed by the same Lua state.
+	 *
+	 * @param msg_ message to push - will be intelligently converted from basic type or table.
+	 * The converted item is moved into the queue.
+	 */
+	void push_lua (const Owned<Item>& msg_)
+	{
+		copy_ptrs(msg_.value);
+		push_item(std::move(msg_.value));
+	}
+
+	/**
+	 * Thread-safely push a message in Lua, unless the queue is at capacity.
+	 *
 	 * @param msg_ message to push - will be intelligently converted from basic type or table.
+	 * The converted item is moved into the queue.
+	 * @return whether the message was appended.
+	 */
+	bool try_push_lua (const Owned<Item>& msg_)
+	{
+		copy_ptrs(msg_.value);
+		return try_push_item(msg_.value);
+	}
+
+	/**
+	 * Thread-safely push an array of messages in Lua, under a single lock acquisition where
+	 * possible.
+	 *
+	 * Blocks if the queue is at capacity.
+	 *
+	 * @param msgs_ array table of messages, converted as for `push_lua`.  The items are moved out.
 	 */
-	void push_lua (Item msg_)
+	void push_many_lua (const Batch<Item>& msgs_)
 	{
-		std::lock_guard<boost::detail::spinlock> lock(m_lock);
-		Item item = boost::apply_visitor(CopyVisitor(), msg_);
-		m_queue.push(item);
+		for (Item& msg : msgs_.items)
+			copy_ptrs(msg);
+		push_items(msgs_.items.begin(), msgs_.items.end());
 	}
 
 	/**
 	 * Thread-safely pop a message in Lua.
 	 *
-	 * @return basic type or table, depending on the message.
+	 * @return basic type or table, depending on the message, converted to Lua straight from the
+	 * popped item.
 	 */
-	boost::optional<Item> pop_lua ()
+	boost::optional<Owned<Item>> pop_lua ()
 	{
-		std::lock_guard<boost::detail::spinlock> lock(m_lock);
-		if (!size_unsafe())
+		boost::optional<Item> item = pop_item();
+		if (!item)
 			return boost::none;
-		Item msg(std::move(m_queue.front()));
-		m_queue.pop();
-		return msg;
+		return Owned<Item>{ std::move(*item) };
+	}
+
+	/**
+	 * Thread-safely pop a message in Lua, converting its fields only as they are read.
+	 *
+	 * @return a proxy for a Map or Vec message (see `Lazy`), otherwise the basic type.
+	 */
+	boost::optional<Lazy<Msg>> pop_lazy_lua ()
+	{
+		boost::optional<Item> item = pop_item();
+		if (!item)
+			return boost::none;
+		auto root = std::make_shared<Item>(std::move(*item));
+		const Item* node = root.get();
+		return Lazy<Msg>{ std::move(root), node };
+	}
+
+	/**
+	 * Thread-safely pop up to `max_` messages in Lua, under a single lock acquisition where
+	 * possible.
+	 *
+	 * @param max_ maximum number of messages to pop.
+	 * @return array table of basic types or tables, in queue order.
+	 */
+	Batch<Item> pop_many_lua (unsigned max_)
+	{
+		Batch<Item> batch;
+		batch.items.reserve(std::min<std::size_t>(max_, m_queue.size()));
+		pop_items(std::back_inserter(batch.items), max_);
+		return batch;
+	}
+
+	/**
+	 * Thread-safely pop all available messages in Lua, under a single lock acquisition where
+	 * possible.
+	 *
+	 * @return array table of basic types or tables, in queue order.
+	 */
+	Batch<Item> drain_lua ()
+	{
+		Batch<Item> batch;
+		batch.items.reserve(m_queue.size());
+		pop_items(std::back_inserter(batch.items), std::numeric_limits<std::size_t>::max());
+		return batch;
+	}
+
+	/**
+	 * Get a percentile of the push-to-pop latencies in Lua.
+	 *
+	 * @param percent_ percentile, from 0 to 100.
+	 * @return latency in nanoseconds, or 0 if none are recorded.
+	 */
+	double latency_lua (double percent_)
+	{
+		return double(m_latency.percentile(percent_));
+	}
+
+	/**
+	 * Forget the push-to-pop latencies recorded, in Lua.
+	 */
+	void reset_latency_lua ()
+	{
+		m_latency.reset();
 	}
 
 	/**
@@ -401,9 +969,19 @@ public:
 		m_lua = Lua(new LuaContext(L));
 		if (!bound_states().count(L))
 		{
-			m_lua->registerFunction("size", &Queue::size);
-			m_lua->registerFunction("push", &Queue::push_lua);
-			m_lua->registerFunction("pop", &Queue::pop_lua);
+			m_lua->registerFunction("size", &BasicQueue::size);
+			m_lua->registerFunction("stats", &BasicQueue::stats);
+			m_lua->registerFunction("latency", &BasicQueue::latency_lua);
+			m_lua->registerFunction("reset_latency", &BasicQueue::reset_latency_lua);
+			m_lua->registerFunction("ready_fd", &BasicQueue::ready_fd);
+			m_lua->registerFunction("push", &BasicQueue::push_lua);
+			m_lua->registerFunction("try_push", &BasicQueue::try_push_lua);
+			m_lua->registerFunction("push_many", &BasicQueue::push_many_lua);
+			m_lua->registerFunction("pop", &BasicQueue::pop_lua);
+			m_lua->registerFunction("pop_lazy", &BasicQueue::pop_lazy_lua);
+			m_lua->registerFunction("pop_many", &BasicQueue::pop_many_lua);
+			m_lua->registerFunction("drain", &BasicQueue::drain_lua);
+			bind_recv(L);
 			bound_states().insert(L);
 		}
 	}
@@ -430,73 +1008,562 @@ public:
 	}
 
 private:
+	/**
+	 * Add `recv` to the methods luawrapper looks up for queues in a Lua state.
+	 *
+	 * `recv` pops like `pop`, but inside a coroutine it yields the readiness descriptor to the
+	 * resumer (typically a `Scheduler`) while the queue is empty.  It is written in Lua, since a
+	 * coroutine can't yield across the C call boundary of luawrapper's function wrappers, so it
+	 * can't be registered with `registerFunction`.  It doesn't need the `coroutine` library open.
+	 *
+	 * This relies on luawrapper internals (`LuaContext::checkTypeRegistration` and the `__index`
+	 * metamethod built by `Pusher<T>::push`): each registered type has a table in the registry
+	 * keyed by the light userdata `&typeid(T)`, whose subtable at index 0 holds the member
+	 * functions `__index` looks a method name up in.  It must follow `registerFunction`, which
+	 * creates those tables.  The "Receiving in coroutines" tests fail if the layout changes.
+	 *
+	 * @param L Lua state to bind to.
+	 * @throws std::logic_error if a queue type's method table isn't in the registry.
+	 */
+	static void bind_recv (lua_State* L)
+	{
+		static const char* const code =
+			"local in_coroutine, yield = ...\n"
+			"return function(self)\n"
+			"  local msg = self:pop()\n"
+			"  while msg == nil do\n"
+			"    if not in_coroutine() then return nil end\n"
+			"    yield(self:ready_fd())\n"
+			"    msg = self:pop()\n"
+			"  end\n"
+			"  return msg\n"
+			"end\n";
+		for (const std::type_info* type :
+			{ &typeid(BasicQueue), &typeid(BasicQueue*), &typeid(std::shared_ptr<BasicQueue>) })
+		{
+			lua_pushlightuserdata(L, const_cast<std::type_info*>(type));
+			lua_gettable(L, LUA_REGISTRYINDEX);
+			if (lua_istable(L, -1))
+			{
+				lua_pushinteger(L, 0);
+				lua_gettable(L, -2);
+			}
+			else
+				lua_pushnil(L);
+			if (!lua_istable(L, -1))
+			{
+				lua_pop(L, 2);
+				throw std::logic_error("luawrapper method table not found for " +
+					std::string(type->name()));
+			}
+			luaL_loadstring(L, code);
+			lua_pushcfunction(L, &in_coroutine);
+			lua_pushcfunction(L, &yield);
+			lua_call(L, 2, 1);
+			lua_setfield(L, -2, "recv");
+			lua_pop(L, 2);
+		}
+	}
+
+	/**
+	 * Lua C function returning whether it is called from a coroutine, rather than the main thread.
+	 */
+	static int in_coroutine (lua_State* L)
+	{
+		const bool main = lua_pushthread(L);
+		lua_pushboolean(L, !main);
+		return 1;
+	}
+
+	/**
+	 * Lua C function yielding its arguments from the calling coroutine.
+	 */
+	static int yield (lua_State* L)
+	{
+		return lua_yield(L, lua_gettop(L));
+	}
+
 	/// Smart pointer to `LuaContext` object used for binding and exposing.
 	Lua m_lua;
 	/// Actual internal queue of messages.
-	std::queue<Item> m_queue;
-	/// Mutex used for locking push/pop/size calls.
-	boost::detail::spinlock m_lock;
+	InternalQueue m_queue;
+	/// Producers waiting for space in a queue at capacity.
+	Signal m_space;
+	/// Consumers waiting for messages in an empty queue.
+	Signal m_items;
+	/// Runtime statistics, empty unless the policy keeps them.
+	Stats m_stats;
+	/// Push-to-pop latencies, empty unless the policy keeps them.
+	Histogram m_latency;
+	/// Readiness descriptor for event loops, null until `ready_fd` is first called.
+	std::atomic<ReadyFd*> m_ready{nullptr};
 
 	/**
 	 * A visitor over the Item variant to duplicate `CopyPtr<T>`s as `T`s.
 	 *
+	 * Maps and Vecs are updated in place, so only `CopyPtr<T>`s themselves are replaced and the
+	 * rest of the tree is neither copied nor moved.
+	 *
 	 * The CustomTypes of the Item must have both `CopyPtr<T>*` and `T` as allowed value types.
 	 */
-	class CopyVisitor : public boost::static_visitor<Item>
+	class CopyVisitor : public boost::static_visitor<boost::optional<Item>>
 	{
 	public:
-		template <class T>
-
 		/**
-		 * Overload taking a pointer to CopyPtr<T> and replacing it with a T.
+		 * Overload taking a pointer to CopyPtr<T> and creating a T to replace it with.
 		 *
 		 * @param to_copy item pointed to for copying.
 		 * @return variant Item containing a T
 		 */
-		Item operator()(CopyPtr<T>* to_copy) const
+		template <class T>
+		boost::optional<Item> operator()(CopyPtr<T>* to_copy) const
 	    {
-			return T(*((T*)to_copy));
+			return Item(T(*((T*)to_copy)));
 	    }
 
 		/**
-		 * Recursively apply this CopyVisitor to values in Map.
+		 * Recursively replace `CopyPtr<T>`s in Map values, in place.
 		 *
 		 * @param to_copy Map to loop over
-		 * @return the updated Map.
+		 * @return `boost::none`, since the Map itself is kept.
 		 */
-		Item operator()(Map& to_copy) const
+		boost::optional<Item> operator()(Map& to_copy) const
 	    {
 			for (auto& item : to_copy)
-				item.second = std::move(boost::apply_visitor(CopyVisitor(), item.second));
+				copy_ptrs(item.second);
+			return boost::none;
+	    }
 
-			return std::move(to_copy);
+		/**
+		 * Recursively replace `CopyPtr<T>`s in Vec elements, in place.
+		 *
+		 * @param to_copy Vec to loop over
+		 * @return `boost::none`, since the Vec itself is kept.
+		 */
+		boost::optional<Item> operator()(Vec& to_copy) const
+	    {
+			for (auto& item : to_copy)
+				copy_ptrs(item);
+			return boost::none;
 	    }
 
 		/**
-		 * Pass-through for all other types (i.e. not Map or CopyPtr).
+		 * Pass-through for all other types (i.e. not Map, Vec or CopyPtr).
 		 *
 		 * @param to_copy general type available to variant Item.
-		 * @return an Item containing the same object as passed.
+		 * @return `boost::none`, since the value is kept.
 		 */
 		template <class T>
-		Item operator()(T& to_copy) const
+		boost::optional<Item> operator()(T&) const
 	    {
-			return std::move(to_copy);
+			return boost::none;
 	    }
 	};
 
 	/**
-	 * Get size of queue without thread-safety.
+	 * Replace any `CopyPtr<T>`s in an Item with copies of the `T`s they point to, in place.
 	 *
-	 * @return size of queue
+	 * @param item_ item to update.
 	 */
-	unsigned size_unsafe ()
+	static void copy_ptrs (Item& item_)
 	{
-		return m_queue.size();
+		boost::optional<Item> copy = boost::apply_visitor(CopyVisitor(), item_);
+		if (copy)
+			item_ = std::move(*copy);
+	}
+
+	/**
+	 * Prepare an Item pushed from C++ for the storage, in place: copy any `CopyPtr<T>`s, or
+	 * serialise it to a `Tape` if the policy asks to and it is plain data.
+	 *
+	 * @param item_ item to update.
+	 */
+	static void prepare (Item& item_)
+	{
+		Tape tape;
+		if (serialise(item_, tape))
+			item_ = std::move(tape);
+		else
+			copy_ptrs(item_);
+	}
+
+	/**
+	 * Serialise an Item pushed from C++ to a `Tape`, if the policy asks to and it is plain data.
+	 *
+	 * Copy-pushes serialise straight from the original rather than copying the tree first.
+	 *
+	 * @param item_ item to serialise.
+	 * @param tape_ tape to encode to.
+	 * @return whether the item was serialised.
+	 */
+	static bool serialise (const Item& item_, Tape& tape_)
+	{
+		return Policy::serialise_on_push && tape_.encode(item_);
+	}
+
+	/**
+	 * Estimate the memory used by a pushed Item, if statistics are kept.
+	 *
+	 * @param item_ item to estimate.
+	 * @return estimated bytes, or 0 if statistics are compiled out.
+	 */
+	static std::size_t item_bytes (const Item& item_)
+	{
+		return Stats::enabled ? sizeof(Item) + estimate_bytes(item_) : 0;
+	}
+
+	/**
+	 * Get the time since `start_`, for statistics on waits.
+	 *
+	 * @param start_ start of the wait.
+	 * @return elapsed nanoseconds.
+	 */
+	static std::uint64_t elapsed_ns (std::chrono::steady_clock::time_point start_)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start_
+		).count();
+	}
+
+	/**
+	 * Decode an Item popped in C++, in place, if it was serialised by `prepare`.
+	 *
+	 * Decoding is only instantiated for policies that serialise, since it constructs variant
+	 * alternatives that other queues never need.
+	 *
+	 * @param item_ popped item.
+	 */
+	static void unpack (Item& item_)
+	{
+		unpack(item_, std::integral_constant<bool, Policy::serialise_on_push>());
+	}
+
+	static void unpack (Item& item_, std::true_type)
+	{
+		const Tape* tape = boost::get<Tape>(&item_);
+		if (tape && !tape->bytes().empty())
+			item_ = tape->template decode<Msg>();
+	}
+
+	static void unpack (Item&, std::false_type) {}
+
+	/**
+	 * Append an already-copied Item to the storage, waiting for space if the queue is at
+	 * capacity.
+	 *
+	 * @param item_ item to append.
+	 */
+	void push_item (Item&& item_)
+	{
+		const std::size_t bytes = item_bytes(item_);
+		bool was_empty;
+		const auto try_push = [this, &item_, &was_empty]() {
+			return try_push_entry(item_, was_empty);
+		};
+		if (!try_push())
+		{
+			const auto start = std::chrono::steady_clock::now();
+			m_space.wait(try_push);
+			m_stats.on_push_wait(elapsed_ns(start));
+		}
+		m_stats.on_push(1, bytes);
+		pushed(was_empty);
+	}
+
+	/**
+	 * Append an already-copied Item to the storage, unless the queue is at capacity.
+	 *
+	 * @param item_ item to append, moved from on success.
+	 * @return whether the item was appended.
+	 */
+	bool try_push_item (Item& item_)
+	{
+		const std::size_t bytes = item_bytes(item_);
+		bool was_empty;
+		if (!try_push_entry(item_, was_empty))
+		{
+			m_stats.on_reject();
+			return false;
+		}
+		m_stats.on_push(1, bytes);
+		pushed(was_empty);
+		return true;
+	}
+
+	/**
+	 * Append an already-copied Item to the storage, waiting up to `timeout_` for space if the
+	 * queue is at capacity.
+	 *
+	 * @param item_ item to append, moved from on success.
+	 * @param timeout_ maximum time to wait for space.
+	 * @return whether the item was appended.
+	 */
+	template <class Rep, class Period>
+	bool push_item_for (Item& item_, const std::chrono::duration<Rep, Period>& timeout_)
+	{
+		const std::size_t bytes = item_bytes(item_);
+		bool was_empty;
+		const auto try_push = [this, &item_, &was_empty]() {
+			return try_push_entry(item_, was_empty);
+		};
+		if (!try_push())
+		{
+			const auto start = std::chrono::steady_clock::now();
+			const bool waited = m_space.wait_for(try_push, timeout_);
+			m_stats.on_push_wait(elapsed_ns(start));
+			if (!waited)
+			{
+				m_stats.on_reject();
+				return false;
+			}
+		}
+		m_stats.on_push(1, bytes);
+		pushed(was_empty);
+		return true;
+	}
+
+	/**
+	 * Append a range of already-copied Items to the storage, waiting for space if the queue is
+	 * at capacity.
+	 *
+	 * @param first_ iterator to first item to append, items are moved from.
+	 * @param last_ iterator past last item to append.
+	 */
+	template <class It>
+	void push_items (It first_, It last_)
+	{
+		std::size_t bytes = 0;
+		if (Stats::enabled)
+			for (It it = first_; it != last_; ++it)
+				bytes += item_bytes(*it);
+		const std::size_t num = std::distance(first_, last_);
+		push_entries(first_, last_, std::is_same<Entry, Item>());
+		m_stats.on_push(num, bytes);
+	}
+
+	/**
+	 * Append a range of Entries to the storage, waiting for space if the queue is at capacity.
+	 *
+	 * @param first_ iterator to first entry to append, entries are moved from.
+	 * @param last_ iterator past last entry to append.
+	 */
+	template <class It>
+	void push_entries (It first_, It last_, std::true_type)
+	{
+		bool was_empty;
+		const auto try_push = [this, &first_, &last_, &was_empty]() {
+			const std::size_t num = m_queue.try_push_bulk(first_, last_, was_empty);
+			std::advance(first_, num);
+			return num != 0;
+		};
+		while (first_ != last_)
+		{
+			if (!try_push())
+			{
+				const auto start = std::chrono::steady_clock::now();
+				m_space.wait(try_push);
+				m_stats.on_push_wait(elapsed_ns(start));
+			}
+			pushed(was_empty);
+		}
+	}
+
+	/**
+	 * Append a range of Items to the storage, stamped with a single push time.
+	 */
+	template <class It>
+	void push_entries (It first_, It last_, std::false_type)
+	{
+		std::vector<Entry> entries;
+		entries.reserve(std::distance(first_, last_));
+		const std::uint64_t stamp = Clock::now();
+		for (; first_ != last_; ++first_)
+			entries.push_back(Entry{ std::move(*first_), stamp });
+		push_entries(entries.begin(), entries.end(), std::true_type());
+	}
+
+	/**
+	 * Append an Item to the storage, stamped with its push time if the policy keeps latencies,
+	 * unless the queue is at capacity.
+	 *
+	 * @param item_ item to append, moved from on success.
+	 * @param was_empty_ set to whether the storage was empty before the push.
+	 * @return whether the item was appended.
+	 */
+	bool try_push_entry (Item& item_, bool& was_empty_)
+	{
+		return try_push_entry(item_, was_empty_, std::is_same<Entry, Item>());
+	}
+
+	bool try_push_entry (Item& item_, bool& was_empty_, std::true_type)
+	{
+		return m_queue.try_push(std::move(item_), was_empty_);
+	}
+
+	bool try_push_entry (Item& item_, bool& was_empty_, std::false_type)
+	{
+		Entry entry{ std::move(item_), Clock::now() };
+		if (m_queue.try_push(std::move(entry), was_empty_))
+			return true;
+		item_ = std::move(entry.item);
+		return false;
+	}
+
+	/**
+	 * Remove the Item at the front of the storage, recording its latency if the policy keeps
+	 * them.
+	 *
+	 * @return the item, or `boost::none` if the queue is empty.
+	 */
+	boost::optional<Item> try_pop_entry (std::true_type)
+	{
+		return m_queue.try_pop();
+	}
+
+	boost::optional<Item> try_pop_entry (std::false_type)
+	{
+		boost::optional<Entry> entry = m_queue.try_pop();
+		if (!entry)
+			return boost::none;
+		record_latency(entry->stamp, Clock::now());
+		return boost::optional<Item>(std::move(entry->item));
+	}
+
+	/**
+	 * Remove up to `max_` Items from the front of the storage, recording their latencies if the
+	 * policy keeps them.
+	 *
+	 * @param out_ output iterator to move removed items to.
+	 * @param max_ maximum number of items to remove.
+	 * @return number of items removed.
+	 */
+	template <class OutIt>
+	std::size_t try_pop_entries (OutIt out_, std::size_t max_, std::true_type)
+	{
+		return m_queue.try_pop_bulk(out_, max_);
+	}
+
+	template <class OutIt>
+	std::size_t try_pop_entries (OutIt out_, std::size_t max_, std::false_type)
+	{
+		std::vector<Entry> entries;
+		const std::size_t num = m_queue.try_pop_bulk(std::back_inserter(entries), max_);
+		const std::uint64_t now = Clock::now();
+		for (Entry& entry : entries)
+		{
+			record_latency(entry.stamp, now);
+			*out_++ = std::move(entry.item);
+		}
+		return num;
+	}
+
+	/**
+	 * Record the latency of a message.
+	 *
+	 * @param stamp_ time it was pushed.
+	 * @param now_ time it was popped.
+	 */
+	void record_latency (std::uint64_t stamp_, std::uint64_t now_)
+	{
+		m_latency.record(Clock::to_ns(now_ > stamp_ ? now_ - stamp_ : 0));
+	}
+
+	/**
+	 * Remove up to `max_` Items from the front of the storage, waking producers waiting for
+	 * space.
+	 *
+	 * @param out_ output iterator to move removed items to.
+	 * @param max_ maximum number of items to remove.
+	 * @return number of items removed.
+	 */
+	template <class OutIt>
+	std::size_t pop_items (OutIt out_, std::size_t max_)
+	{
+		const std::size_t num = try_pop_entries(out_, max_, std::is_same<Entry, Item>());
+		if (num)
+		{
+			m_stats.on_pop(num);
+			m_space.notify_all();
+		}
+		settle_ready();
+		return num;
+	}
+
+	/**
+	 * Wake a consumer waiting for messages, if the queue has just become non-empty.
+	 *
+	 * Pushes to an already non-empty queue don't notify, so a busy producer pays nothing.
+	 *
+	 * @param was_empty_ whether consumers may have found the queue empty before the push became
+	 * visible to them.
+	 */
+	void pushed (bool was_empty_)
+	{
+		if (was_empty_)
+		{
+			m_items.notify_one();
+			if (ReadyFd* ready = m_ready.load())
+				ready->signal();
+		}
+	}
+
+	/**
+	 * Clear the readiness descriptor, if there is one, once a pop has left the queue empty.
+	 *
+	 * A producer may push between the size check and the clear, after its own signal was
+	 * consumed by the clear, so the size is checked again afterwards and the descriptor
+	 * re-signalled rather than missing the wake-up.
+	 */
+	void settle_ready ()
+	{
+		ReadyFd* ready = m_ready.load();
+		if (!ready || m_queue.size())
+			return;
+		ready->clear();
+		if (m_queue.size())
+			ready->signal();
+	}
+
+	/**
+	 * Wake another waiting consumer if messages remain after a woken consumer has popped.
+	 *
+	 * Since only the empty to non-empty transition notifies, woken consumers pass the signal on
+	 * so a burst of messages doesn't sit behind a single consumer.
+	 */
+	void pass_items_signal ()
+	{
+		if (m_queue.size())
+			m_items.notify_one();
+	}
+
+	/**
+	 * Remove the Item at the front of the storage, waking a producer waiting for space.
+	 *
+	 * @return the item, or `boost::none` if the queue is empty.
+	 */
+	boost::optional<Item> pop_item ()
+	{
+		boost::optional<Item> item = try_pop_entry(std::is_same<Entry, Item>());
+		if (item)
+		{
+			m_stats.on_pop(1);
+			m_space.notify_one();
+		}
+		settle_ready();
+		return item;
 	}
 };
 
 
+/**
+ * Thread-safe C++/Lua queue of `Message`s, using the default policy.
+ *
+ * @tparam CustomTypes list of additional types in the variant map/table.
+ */
+template <class... CustomTypes>
+using Queue = BasicQueue<DefaultPolicy, CustomTypes...>;
+
+
 
 } /* namespace LuaCppMsg */
 
@@ -0,0 +1,86 @@
+#ifndef INCLUDE_LUACPPMSG_BATCH_HPP_
+#define INCLUDE_LUACPPMSG_BATCH_HPP_
+
+#include <utility>
+#include <vector>
+#include <LuaContext.hpp>
+#include <LuaCppMsg/Compat.hpp>
+#include <LuaCppMsg/Owned.hpp>
+
+namespace LuaCppMsg
+{
+
+/**
+ * A batch of items passed between a queue and Lua as a single array table.
+ *
+ * @tparam T type of item in the batch.
+ */
+template <class T>
+struct Batch
+{
+	/// Items in the batch, in queue order.  Mutable so the queue can move them out of a batch
+	/// read from Lua, which "luawrapper" only hands over by const reference.
+	mutable std::vector<T> items;
+};
+
+} /* namespace LuaCppMsg */
+
+
+/**
+ * Push a `Batch` to Lua as an array table, presized to the number of items.
+ *
+ * Items are consumed as they are pushed, as for `Owned` values.
+ */
+template <class T>
+struct LuaContext::Pusher<LuaCppMsg::Batch<T>>
+{
+	static const int minSize = 1;
+	static const int maxSize = 1;
+
+	static PushedObject push(lua_State* state, LuaCppMsg::Batch<T>&& batch) noexcept
+	{
+		lua_createtable(state, (int)batch.items.size(), 0);
+		for (std::size_t i = 0; i < batch.items.size(); i++)
+		{
+			Pusher<LuaCppMsg::Owned<T>>::push(state, std::move(batch.items[i])).release();
+			lua_rawseti(state, -2, (int)i + 1);
+		}
+		return PushedObject{state, 1};
+	}
+};
+
+
+/**
+ * Read a `Batch` from a Lua array table, converting every element.
+ *
+ * Fails if the value isn't a table, or any element of its array part can't be converted.
+ * Elements are converted as for `Owned` values.
+ */
+template <class T>
+struct LuaContext::Reader<LuaCppMsg::Batch<T>>
+{
+	static auto read(lua_State* state, int index)
+		-> boost::optional<LuaCppMsg::Batch<T>>
+	{
+		if (!lua_istable(state, index))
+			return boost::none;
+
+		const int size = (int)LuaCppMsg::raw_len(state, index);
+		LuaCppMsg::Batch<T> batch;
+		batch.items.reserve(size);
+
+		for (int i = 1; i <= size; i++)
+		{
+			lua_rawgeti(state, index, i);
+			auto item = Reader<LuaCppMsg::Owned<T>>::read_value(state, -1);
+			lua_pop(state, 1);
+			if (!item)
+				return boost::none;
+			batch.items.push_back(std::move(*item));
+		}
+
+		return { std::move(batch) };
+	}
+};
+
+#endif /* INCLUDE_LUACPPMSG_BATCH_HPP_ */
@@ -0,0 +1,176 @@
+#ifndef INCLUDE_LUACPPMSG_BLOB_HPP_
+#define INCLUDE_LUACPPMSG_BLOB_HPP_
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <typeinfo>
+#include <utility>
+#include <LuaContext.hpp>
+
+namespace LuaCppMsg
+{
+
+/**
+ * Immutable, reference-counted buffer of bytes.
+ *
+ * Copying a `Blob` only bumps a reference count, so binary payloads (e.g. images or packed
+ * protocol frames) are handed between queue stages and Lua without copying the bytes.
+ */
+class Blob
+{
+public:
+	/**
+	 * Construct an empty buffer.
+	 */
+	Blob () = default;
+
+	/**
+	 * Construct taking ownership of the bytes of a string, without copying them.
+	 *
+	 * @param bytes_ bytes, moved from.
+	 */
+	explicit Blob (std::string&& bytes_)
+		: m_bytes(std::make_shared<const std::string>(std::move(bytes_)))
+	{}
+
+	/**
+	 * Construct copying a range of bytes.
+	 *
+	 * @param data_ pointer to first byte.
+	 * @param size_ number of bytes.
+	 */
+	Blob (const void* data_, std::size_t size_)
+		: m_bytes(std::make_shared<const std::string>(static_cast<const char*>(data_), size_))
+	{}
+
+	/**
+	 * Get a pointer to the first byte.
+	 *
+	 * @return pointer to the bytes.
+	 */
+	const char* data () const
+	{
+		return str().data();
+	}
+
+	/**
+	 * Get the number of bytes.
+	 *
+	 * @return number of bytes.
+	 */
+	std::size_t size () const
+	{
+		return str().size();
+	}
+
+	/**
+	 * Get the bytes as a string, without copying them.
+	 *
+	 * @return reference to the bytes, valid while this buffer exists.
+	 */
+	const std::string& str () const
+	{
+		static const std::string empty;
+		return m_bytes ? *m_bytes : empty;
+	}
+
+private:
+	/// The bytes, shared between copies of this buffer.
+	std::shared_ptr<const std::string> m_bytes;
+};
+
+} /* namespace LuaCppMsg */
+
+
+/**
+ * Push a `Blob` to Lua as a read-only userdata, sharing its bytes.
+ *
+ * From Lua, `#blob` and `blob.len` get the number of bytes and `blob.ptr` gets a light userdata
+ * pointer to the first byte, e.g. for `ffi.cast("const uint8_t*", blob.ptr)` in LuaJIT.  The
+ * bytes are only copied into a Lua string by `tostring(blob)` or `blob:tostring()`.
+ */
+template <>
+struct LuaContext::Pusher<LuaCppMsg::Blob>
+{
+	static const int minSize = 1;
+	static const int maxSize = 1;
+
+	static PushedObject push(lua_State* state, LuaCppMsg::Blob value) noexcept
+	{
+		new (lua_newuserdata(state, sizeof(LuaCppMsg::Blob))) LuaCppMsg::Blob(std::move(value));
+
+		if (luaL_newmetatable(state, name()))
+		{
+			lua_pushlightuserdata(state, const_cast<std::type_info*>(&typeid(LuaCppMsg::Blob)));
+			lua_setfield(state, -2, "_typeid");
+			lua_pushcfunction(state, &gc);
+			lua_setfield(state, -2, "__gc");
+			lua_pushcfunction(state, &index);
+			lua_setfield(state, -2, "__index");
+			lua_pushcfunction(state, &len);
+			lua_setfield(state, -2, "__len");
+			lua_pushcfunction(state, &tostring);
+			lua_setfield(state, -2, "__tostring");
+		}
+		lua_setmetatable(state, -2);
+		return PushedObject{state, 1};
+	}
+
+private:
+	/**
+	 * Name of the metatable in the registry.
+	 */
+	static const char* name()
+	{
+		return "LuaCppMsg.Blob";
+	}
+
+	/**
+	 * Get the Blob that is the first argument, raising a Lua error if it isn't one.
+	 */
+	static LuaCppMsg::Blob& self(lua_State* state)
+	{
+		return *static_cast<LuaCppMsg::Blob*>(luaL_checkudata(state, 1, name()));
+	}
+
+	static int gc(lua_State* state)
+	{
+		self(state).~Blob();
+		return 0;
+	}
+
+	static int len(lua_State* state)
+	{
+		lua_pushnumber(state, static_cast<lua_Number>(self(state).size()));
+		return 1;
+	}
+
+	static int tostring(lua_State* state)
+	{
+		const LuaCppMsg::Blob& blob = self(state);
+		lua_pushlstring(state, blob.data(), blob.size());
+		return 1;
+	}
+
+	static int index(lua_State* state)
+	{
+		const LuaCppMsg::Blob& blob = self(state);
+		const char* key = lua_type(state, 2) == LUA_TSTRING ? lua_tostring(state, 2) : nullptr;
+		if (!key)
+			lua_pushnil(state);
+		else if (!std::strcmp(key, "ptr"))
+			lua_pushlightuserdata(state, const_cast<char*>(blob.data()));
+		else if (!std::strcmp(key, "len"))
+			lua_pushnumber(state, static_cast<lua_Number>(blob.size()));
+		else if (!std::strcmp(key, "tostring"))
+			lua_pushcfunction(state, &tostring);
+		else
+			lua_pushnil(state);
+		return 1;
+	}
+};
+
+#endif /* INCLUDE_LUACPPMSG_BLOB_HPP_ */
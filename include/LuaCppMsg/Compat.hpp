@@ -0,0 +1,69 @@
+#ifndef INCLUDE_LUACPPMSG_COMPAT_HPP_
+#define INCLUDE_LUACPPMSG_COMPAT_HPP_
+
+#include <cstddef>
+#include <lua.hpp>
+
+namespace LuaCppMsg
+{
+
+/**
+ * Get the length of the array part of a table, without invoking metamethods.
+ *
+ * @param state Lua state.
+ * @param index stack index of the table.
+ * @return length of the table's sequence.
+ */
+inline std::size_t raw_len (lua_State* state, int index)
+{
+#	if LUA_VERSION_NUM >= 502
+		return lua_rawlen(state, index);
+#	else
+		return lua_objlen(state, index);
+#	endif
+}
+
+/**
+ * Convert a relative stack index to an absolute one, so it stays valid as values are pushed.
+ *
+ * @param state Lua state.
+ * @param index stack index, relative or absolute.
+ * @return equivalent absolute (or pseudo) index.
+ */
+inline int abs_index (lua_State* state, int index)
+{
+#	if LUA_VERSION_NUM >= 502
+		return lua_absindex(state, index);
+#	else
+		return index > 0 || index <= LUA_REGISTRYINDEX ? index : lua_gettop(state) + index + 1;
+#	endif
+}
+
+/**
+ * Start or resume a coroutine.
+ *
+ * @param thread coroutine to resume, with its function (if starting) and arguments on its stack.
+ * @param from thread resuming it.
+ * @param nargs number of arguments on the coroutine's stack.
+ * @param nresults set to the number of values yielded or returned, on the coroutine's stack.
+ * @return `LUA_YIELD`, 0 if the coroutine finished, or an error code.
+ */
+inline int resume (lua_State* thread, lua_State* from, int nargs, int& nresults)
+{
+#	if LUA_VERSION_NUM >= 504
+		return lua_resume(thread, from, nargs, &nresults);
+#	elif LUA_VERSION_NUM >= 502
+		const int status = lua_resume(thread, from, nargs);
+		nresults = lua_gettop(thread);
+		return status;
+#	else
+		(void)from;
+		const int status = lua_resume(thread, nargs);
+		nresults = lua_gettop(thread);
+		return status;
+#	endif
+}
+
+} /* namespace LuaCppMsg */
+
+#endif /* INCLUDE_LUACPPMSG_COMPAT_HPP_ */
@@ -0,0 +1,278 @@
+#ifndef INCLUDE_LUACPPMSG_DENSE_HPP_
+#define INCLUDE_LUACPPMSG_DENSE_HPP_
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+#include <LuaContext.hpp>
+
+namespace LuaCppMsg
+{
+
+/**
+ * Immutable, reference-counted, contiguous array of numbers.
+ *
+ * Copying a `Dense` only bumps a reference count, so large numeric payloads (e.g. sensor frames)
+ * are handed between threads and Lua in constant time, rather than as one `Item` per element.
+ *
+ * Elements are `double`, `float` or `int32_t`.
+ */
+class Dense
+{
+public:
+	/// Type of the elements.
+	enum class Type { Float64, Float32, Int32 };
+
+	/**
+	 * Construct an empty array of doubles.
+	 */
+	Dense () : m_data(nullptr), m_size(0), m_type(Type::Float64) {}
+
+	/**
+	 * Construct taking ownership of a vector of numbers, without copying the elements.
+	 *
+	 * @param values_ elements, moved from.
+	 */
+	template <class T>
+	Dense (std::vector<T>&& values_)
+	{
+		auto owner = std::make_shared<std::vector<T>>(std::move(values_));
+		m_data = owner->data();
+		m_size = owner->size();
+		m_type = TypeOf<T>::value;
+		m_buffer = std::move(owner);
+	}
+
+	/**
+	 * Get the type of the elements.
+	 *
+	 * @return element type.
+	 */
+	Type type () const
+	{
+		return m_type;
+	}
+
+	/**
+	 * Get the number of elements.
+	 *
+	 * @return number of elements.
+	 */
+	std::size_t size () const
+	{
+		return m_size;
+	}
+
+	/**
+	 * Get the size of each element.
+	 *
+	 * @return bytes per element.
+	 */
+	std::size_t element_size () const
+	{
+		switch (m_type)
+		{
+		case Type::Float32:
+			return sizeof(float);
+		case Type::Int32:
+			return sizeof(std::int32_t);
+		default:
+			return sizeof(double);
+		}
+	}
+
+	/**
+	 * Get a pointer to the first element.
+	 *
+	 * @return untyped pointer to the elements.
+	 */
+	const void* data () const
+	{
+		return m_data;
+	}
+
+	/**
+	 * Get a typed pointer to the first element.
+	 *
+	 * @tparam T element type, which must match `type()`.
+	 * @return pointer to the elements.
+	 * @throws std::bad_cast if `T` doesn't match the element type.
+	 */
+	template <class T>
+	const T* data () const
+	{
+		if (TypeOf<T>::value != m_type)
+			throw std::bad_cast();
+		return static_cast<const T*>(m_data);
+	}
+
+	/**
+	 * Get an element converted to a double.
+	 *
+	 * @param idx_ 0-based index of element, which must be less than `size()`.
+	 * @return value of element.
+	 */
+	double operator[] (std::size_t idx_) const
+	{
+		switch (m_type)
+		{
+		case Type::Float32:
+			return static_cast<const float*>(m_data)[idx_];
+		case Type::Int32:
+			return static_cast<const std::int32_t*>(m_data)[idx_];
+		default:
+			return static_cast<const double*>(m_data)[idx_];
+		}
+	}
+
+	/**
+	 * Get the C name of the element type, e.g. for a LuaJIT FFI cast.
+	 *
+	 * @return "double", "float" or "int32_t".
+	 */
+	const char* type_name () const
+	{
+		switch (m_type)
+		{
+		case Type::Float32:
+			return "float";
+		case Type::Int32:
+			return "int32_t";
+		default:
+			return "double";
+		}
+	}
+
+private:
+	/// Keeps the elements alive while any copy of this array exists.
+	std::shared_ptr<const void> m_buffer;
+	/// Pointer to the first element.
+	const void* m_data;
+	/// Number of elements.
+	std::size_t m_size;
+	/// Type of the elements.
+	Type m_type;
+
+	/// Element type enumerator of a C++ type, only defined for supported types.
+	template <class T>
+	struct TypeOf;
+};
+
+template <>
+struct Dense::TypeOf<double>
+{
+	static const Type value = Type::Float64;
+};
+
+template <>
+struct Dense::TypeOf<float>
+{
+	static const Type value = Type::Float32;
+};
+
+template <>
+struct Dense::TypeOf<std::int32_t>
+{
+	static const Type value = Type::Int32;
+};
+
+} /* namespace LuaCppMsg */
+
+
+/**
+ * Push a `Dense` array to Lua as a read-only userdata, sharing its elements.
+ *
+ * From Lua, `arr[i]` gets the element at 1-based index `i`, `#arr` and `arr.len` get the number
+ * of elements, `arr.ptr` gets a light userdata pointer to the first element and `arr.type` gets
+ * the C element type, so a LuaJIT script can view the elements without conversion:
+ * `ffi.cast(arr.type .. "*", arr.ptr)`.
+ */
+template <>
+struct LuaContext::Pusher<LuaCppMsg::Dense>
+{
+	static const int minSize = 1;
+	static const int maxSize = 1;
+
+	static PushedObject push(lua_State* state, LuaCppMsg::Dense value) noexcept
+	{
+		new (lua_newuserdata(state, sizeof(LuaCppMsg::Dense))) LuaCppMsg::Dense(std::move(value));
+
+		if (luaL_newmetatable(state, name()))
+		{
+			lua_pushlightuserdata(state, const_cast<std::type_info*>(&typeid(LuaCppMsg::Dense)));
+			lua_setfield(state, -2, "_typeid");
+			lua_pushcfunction(state, &gc);
+			lua_setfield(state, -2, "__gc");
+			lua_pushcfunction(state, &index);
+			lua_setfield(state, -2, "__index");
+			lua_pushcfunction(state, &len);
+			lua_setfield(state, -2, "__len");
+		}
+		lua_setmetatable(state, -2);
+		return PushedObject{state, 1};
+	}
+
+private:
+	/**
+	 * Name of the metatable in the registry.
+	 */
+	static const char* name()
+	{
+		return "LuaCppMsg.Dense";
+	}
+
+	/**
+	 * Get the Dense that is the first argument, raising a Lua error if it isn't one.
+	 */
+	static LuaCppMsg::Dense& self(lua_State* state)
+	{
+		return *static_cast<LuaCppMsg::Dense*>(luaL_checkudata(state, 1, name()));
+	}
+
+	static int gc(lua_State* state)
+	{
+		self(state).~Dense();
+		return 0;
+	}
+
+	static int len(lua_State* state)
+	{
+		lua_pushnumber(state, static_cast<lua_Number>(self(state).size()));
+		return 1;
+	}
+
+	static int index(lua_State* state)
+	{
+		const LuaCppMsg::Dense& arr = self(state);
+		if (lua_type(state, 2) == LUA_TNUMBER)
+		{
+			const lua_Number i = lua_tonumber(state, 2);
+			if (i >= 1 && i <= arr.size() && i == std::floor(i))
+				lua_pushnumber(state, arr[static_cast<std::size_t>(i) - 1]);
+			else
+				lua_pushnil(state);
+			return 1;
+		}
+
+		const char* key = lua_tostring(state, 2);
+		if (!key)
+			lua_pushnil(state);
+		else if (!std::strcmp(key, "ptr"))
+			lua_pushlightuserdata(state, const_cast<void*>(arr.data()));
+		else if (!std::strcmp(key, "len"))
+			lua_pushnumber(state, static_cast<lua_Number>(arr.size()));
+		else if (!std::strcmp(key, "type"))
+			lua_pushstring(state, arr.type_name());
+		else
+			lua_pushnil(state);
+		return 1;
+	}
+};
+
+#endif /* INCLUDE_LUACPPMSG_DENSE_HPP_ */
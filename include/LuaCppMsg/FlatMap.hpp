@@ -0,0 +1,506 @@
+#ifndef INCLUDE_LUACPPMSG_FLATMAP_HPP_
+#define INCLUDE_LUACPPMSG_FLATMAP_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+#include <boost/variant.hpp>
+#include <LuaContext.hpp>
+
+namespace LuaCppMsg
+{
+
+/**
+ * Ordering of `FlatMap` keys, which is `std::less` unless specialised.
+ *
+ * @tparam K key type.
+ */
+template <class K>
+struct KeyLess : std::less<K> {};
+
+/**
+ * Ordering of message keys, which also compares them with an `int` or a string (e.g. a
+ * `boost::string_view` or `const char*`) directly, so a key can be looked up without constructing
+ * a `std::string` and variant.
+ *
+ * Consistent with `boost::variant`'s own `operator<`: all `int` keys precede all string keys.
+ */
+template <>
+struct KeyLess<boost::variant<int, std::string>>
+{
+private:
+	/// Enabled for string-like types: `boost::string_view`, `const char*` and `std::string`.
+	template <class S>
+	using IfString = typename std::enable_if<
+		std::is_convertible<const S&, boost::string_view>::value
+	>::type;
+
+public:
+	using Key = boost::variant<int, std::string>;
+	using is_transparent = void;
+
+	bool operator() (const Key& lhs_, const Key& rhs_) const
+	{
+		return lhs_ < rhs_;
+	}
+
+	bool operator() (const Key& lhs_, int rhs_) const
+	{
+		const int* lhs = boost::get<int>(&lhs_);
+		return lhs && *lhs < rhs_;
+	}
+
+	bool operator() (int lhs_, const Key& rhs_) const
+	{
+		const int* rhs = boost::get<int>(&rhs_);
+		return !rhs || lhs_ < *rhs;
+	}
+
+	template <class S, class = IfString<S>>
+	bool operator() (const Key& lhs_, const S& rhs_) const
+	{
+		const std::string* lhs = boost::get<std::string>(&lhs_);
+		return !lhs || boost::string_view(*lhs) < boost::string_view(rhs_);
+	}
+
+	template <class S, class = IfString<S>>
+	bool operator() (const S& lhs_, const Key& rhs_) const
+	{
+		const std::string* rhs = boost::get<std::string>(&rhs_);
+		return rhs && boost::string_view(lhs_) < boost::string_view(*rhs);
+	}
+};
+
+/**
+ * Associative container storing its entries contiguously, sorted by key.
+ *
+ * A drop-in for the subset of `std::unordered_map` used for messages, but with a single
+ * allocation for all entries and binary search lookup, which suits the small maps most messages
+ * are made of.
+ *
+ * Insertion is linear in the number of entries, so wide maps should be built with `reserve`
+ * and in key order, or from a vector of entries in any order.
+ *
+ * @tparam K key type.
+ * @tparam V mapped type.
+ * @tparam Compare ordering of keys.  If it defines `is_transparent`, then `find`, `count` and
+ * `at` also accept any type it can compare with a key.
+ */
+template <class K, class V, class Compare = KeyLess<K>>
+class FlatMap
+{
+public:
+	using key_type = K;
+	using mapped_type = V;
+	using key_compare = Compare;
+	using value_type = std::pair<K, V>;
+	using size_type = std::size_t;
+	using iterator = typename std::vector<value_type>::iterator;
+	using const_iterator = typename std::vector<value_type>::const_iterator;
+
+	FlatMap () = default;
+
+	/**
+	 * Construct from a list of entries.  Later duplicate keys are ignored.
+	 *
+	 * @param entries_ entries to copy.
+	 */
+	FlatMap (std::initializer_list<value_type> entries_)
+	{
+		reserve(entries_.size());
+		for (const value_type& entry : entries_)
+			emplace(entry.first, entry.second);
+	}
+
+	/**
+	 * Construct from entries in any order, sorting them once rather than inserting each in
+	 * turn.  Later duplicate keys are ignored.
+	 *
+	 * Entries already in key order are adopted without being moved.  Otherwise they are sorted
+	 * by index and each moved once, since moving a recursive variant may allocate.
+	 *
+	 * @param entries_ entries to take.
+	 */
+	explicit FlatMap (std::vector<value_type>&& entries_)
+	{
+		const Compare less;
+		const auto sorted = std::adjacent_find(entries_.begin(), entries_.end(),
+			[&less](const value_type& lhs_, const value_type& rhs_) {
+				return !less(lhs_.first, rhs_.first);
+			}
+		) == entries_.end();
+		if (sorted)
+		{
+			m_entries.swap(entries_);
+			return;
+		}
+
+		std::vector<std::size_t> order(entries_.size());
+		for (std::size_t i = 0; i < order.size(); i++)
+			order[i] = i;
+		// Ties are broken by position, so the first of duplicate keys is kept, without the
+		// buffer `std::stable_sort` would allocate.
+		std::sort(order.begin(), order.end(),
+			[&less, &entries_](std::size_t lhs_, std::size_t rhs_) {
+				const K& lhs = entries_[lhs_].first;
+				const K& rhs = entries_[rhs_].first;
+				return less(lhs, rhs) || (!less(rhs, lhs) && lhs_ < rhs_);
+			}
+		);
+		m_entries.reserve(entries_.size());
+		for (std::size_t i : order)
+			if (m_entries.empty() || less(m_entries.back().first, entries_[i].first))
+				m_entries.push_back(std::move(entries_[i]));
+	}
+
+	iterator begin () { return m_entries.begin(); }
+	iterator end () { return m_entries.end(); }
+	const_iterator begin () const { return m_entries.begin(); }
+	const_iterator end () const { return m_entries.end(); }
+	const_iterator cbegin () const { return m_entries.cbegin(); }
+	const_iterator cend () const { return m_entries.cend(); }
+
+	size_type size () const { return m_entries.size(); }
+	bool empty () const { return m_entries.empty(); }
+	void clear () { m_entries.clear(); }
+
+	/**
+	 * Allocate space for at least `size_` entries.
+	 *
+	 * @param size_ number of entries.
+	 */
+	void reserve (size_type size_)
+	{
+		if (size_ > m_entries.capacity())
+			relocate(size_);
+	}
+
+	/**
+	 * Find the entry with the given key.
+	 *
+	 * @param key_ key to look up.
+	 * @return iterator to the entry, or `end()` if not found.
+	 */
+	iterator find (const K& key_)
+	{
+		return find_key(key_);
+	}
+
+	/**
+	 * Find the entry with the given key.
+	 *
+	 * @param key_ key to look up.
+	 * @return iterator to the entry, or `end()` if not found.
+	 */
+	const_iterator find (const K& key_) const
+	{
+		return find_key(key_);
+	}
+
+	/**
+	 * Find the entry with a key equivalent to the given value, without converting it to a key.
+	 *
+	 * @param key_ value comparable with keys by `Compare`.
+	 * @return iterator to the entry, or `end()` if not found.
+	 */
+	template <class Q, class C = Compare, class = typename C::is_transparent>
+	iterator find (const Q& key_)
+	{
+		return find_key(key_);
+	}
+
+	/**
+	 * Find the entry with a key equivalent to the given value, without converting it to a key.
+	 *
+	 * @param key_ value comparable with keys by `Compare`.
+	 * @return iterator to the entry, or `end()` if not found.
+	 */
+	template <class Q, class C = Compare, class = typename C::is_transparent>
+	const_iterator find (const Q& key_) const
+	{
+		return find_key(key_);
+	}
+
+	/**
+	 * Count the entries with the given key.
+	 *
+	 * @param key_ key to look up.
+	 * @return 1 if found, otherwise 0.
+	 */
+	size_type count (const K& key_) const
+	{
+		return find_key(key_) != end();
+	}
+
+	/**
+	 * Count the entries with a key equivalent to the given value.
+	 *
+	 * @param key_ value comparable with keys by `Compare`.
+	 * @return 1 if found, otherwise 0.
+	 */
+	template <class Q, class C = Compare, class = typename C::is_transparent>
+	size_type count (const Q& key_) const
+	{
+		return find_key(key_) != end();
+	}
+
+	/**
+	 * Get the value with the given key.
+	 *
+	 * @param key_ key to look up.
+	 * @return reference to the value.
+	 * @throws std::out_of_range if not found.
+	 */
+	V& at (const K& key_)
+	{
+		iterator it = find(key_);
+		if (it == end())
+			throw std::out_of_range("FlatMap::at");
+		return it->second;
+	}
+
+	/**
+	 * Get the value with the given key.
+	 *
+	 * @param key_ key to look up.
+	 * @return reference to the value.
+	 * @throws std::out_of_range if not found.
+	 */
+	const V& at (const K& key_) const
+	{
+		const_iterator it = find(key_);
+		if (it == end())
+			throw std::out_of_range("FlatMap::at");
+		return it->second;
+	}
+
+	/**
+	 * Get the value with a key equivalent to the given value.
+	 *
+	 * @param key_ value comparable with keys by `Compare`.
+	 * @return reference to the value.
+	 * @throws std::out_of_range if not found.
+	 */
+	template <class Q, class C = Compare, class = typename C::is_transparent>
+	const V& at (const Q& key_) const
+	{
+		const_iterator it = find_key(key_);
+		if (it == end())
+			throw std::out_of_range("FlatMap::at");
+		return it->second;
+	}
+
+	/**
+	 * Get the value with the given key, inserting a default-constructed value if not found.
+	 *
+	 * @param key_ key to look up.
+	 * @return reference to the value.
+	 */
+	V& operator[] (const K& key_)
+	{
+		iterator it = lower_bound(key_);
+		if (it == end() || Compare()(key_, it->first))
+			it = insert_at(it, K(key_), V());
+		return it->second;
+	}
+
+	/**
+	 * Insert an entry, unless one with the same key exists.
+	 *
+	 * @param key_ key of the entry.
+	 * @param value_ value of the entry.
+	 * @return iterator to the entry with the key, and whether it was inserted.
+	 */
+	template <class KArg, class VArg>
+	std::pair<iterator, bool> emplace (KArg&& key_, VArg&& value_)
+	{
+		K key(std::forward<KArg>(key_));
+		iterator it = lower_bound(key);
+		if (it != end() && !Compare()(key, it->first))
+			return { it, false };
+		return { insert_at(it, std::move(key), V(std::forward<VArg>(value_))), true };
+	}
+
+	/**
+	 * Insert an entry, unless one with the same key exists.
+	 *
+	 * @param entry_ entry to insert.
+	 * @return iterator to the entry with the key, and whether it was inserted.
+	 */
+	std::pair<iterator, bool> insert (value_type&& entry_)
+	{
+		return emplace(std::move(entry_.first), std::move(entry_.second));
+	}
+
+	/**
+	 * Insert an entry, unless one with the same key exists.
+	 *
+	 * @param entry_ entry to insert.
+	 * @return iterator to the entry with the key, and whether it was inserted.
+	 */
+	std::pair<iterator, bool> insert (const value_type& entry_)
+	{
+		return emplace(entry_.first, entry_.second);
+	}
+
+	/**
+	 * Remove an entry.
+	 *
+	 * @param it_ iterator to the entry.
+	 * @return iterator to the following entry.
+	 */
+	iterator erase (const_iterator it_)
+	{
+		return m_entries.erase(it_);
+	}
+
+	/**
+	 * Remove the entry with the given key, if any.
+	 *
+	 * @param key_ key to look up.
+	 * @return number of entries removed.
+	 */
+	size_type erase (const K& key_)
+	{
+		iterator it = find(key_);
+		if (it == end())
+			return 0;
+		m_entries.erase(it);
+		return 1;
+	}
+
+private:
+	/// Entries, sorted by key.
+	std::vector<value_type> m_entries;
+
+	template <class Q>
+	iterator lower_bound (const Q& key_)
+	{
+		return std::lower_bound(begin(), end(), key_, &key_less<Q>);
+	}
+
+	template <class Q>
+	const_iterator lower_bound (const Q& key_) const
+	{
+		return std::lower_bound(begin(), end(), key_, &key_less<Q>);
+	}
+
+	template <class Q>
+	iterator find_key (const Q& key_)
+	{
+		iterator it = lower_bound(key_);
+		return it != end() && !Compare()(key_, it->first) ? it : end();
+	}
+
+	template <class Q>
+	const_iterator find_key (const Q& key_) const
+	{
+		const_iterator it = lower_bound(key_);
+		return it != end() && !Compare()(key_, it->first) ? it : end();
+	}
+
+	template <class Q>
+	static bool key_less (const value_type& entry_, const Q& key_)
+	{
+		return Compare()(entry_.first, key_);
+	}
+
+	/**
+	 * Insert an entry before `it_`, growing geometrically if full.
+	 */
+	iterator insert_at (iterator it_, K&& key_, V&& value_)
+	{
+		if (m_entries.size() == m_entries.capacity())
+		{
+			const std::size_t pos = it_ - begin();
+			relocate(std::max<std::size_t>(4, 2 * m_entries.capacity()));
+			it_ = begin() + pos;
+		}
+		return m_entries.emplace(it_, std::move(key_), std::move(value_));
+	}
+
+	/**
+	 * Reallocate to the given capacity.
+	 *
+	 * Entries are moved explicitly, since `std::vector` would otherwise copy them when their
+	 * move constructor may throw, as for recursive variants.
+	 */
+	void relocate (std::size_t capacity_)
+	{
+		std::vector<value_type> entries;
+		entries.reserve(capacity_);
+		entries.insert(
+			entries.end(),
+			std::make_move_iterator(m_entries.begin()), std::make_move_iterator(m_entries.end())
+		);
+		m_entries.swap(entries);
+	}
+};
+
+} /* namespace LuaCppMsg */
+
+
+/**
+ * Push a `FlatMap` to Lua as a table.
+ */
+template <class K, class V, class C>
+struct LuaContext::Pusher<LuaCppMsg::FlatMap<K, V, C>>
+{
+	static const int minSize = 1;
+	static const int maxSize = 1;
+
+	static PushedObject push(lua_State* state, const LuaCppMsg::FlatMap<K, V, C>& value) noexcept
+	{
+		lua_createtable(state, 0, static_cast<int>(value.size()));
+		for (const auto& entry : value)
+		{
+			Pusher<K>::push(state, entry.first).release();
+			Pusher<V>::push(state, entry.second).release();
+			lua_settable(state, -3);
+		}
+		return PushedObject{state, 1};
+	}
+};
+
+
+/**
+ * Read a `FlatMap` from a Lua table, converting every key and value.
+ *
+ * Fails if the value isn't a table, or any key or value can't be converted.
+ */
+template <class K, class V, class C>
+struct LuaContext::Reader<LuaCppMsg::FlatMap<K, V, C>>
+{
+	static auto read(lua_State* state, int index)
+		-> boost::optional<LuaCppMsg::FlatMap<K, V, C>>
+	{
+		if (!lua_istable(state, index))
+			return boost::none;
+
+		LuaCppMsg::FlatMap<K, V, C> result;
+		lua_pushnil(state);
+		while (lua_next(state, (index > 0) ? index : (index - 1)) != 0)
+		{
+			auto key = Reader<K>::read(state, -2);
+			auto value = Reader<V>::read(state, -1);
+			lua_pop(state, 1);
+			if (!key || !value)
+			{
+				lua_pop(state, 1);
+				return boost::none;
+			}
+			result.emplace(std::move(*key), std::move(*value));
+		}
+		return { std::move(result) };
+	}
+};
+
+#endif /* INCLUDE_LUACPPMSG_FLATMAP_HPP_ */
@@ -0,0 +1,241 @@
+#ifndef INCLUDE_LUACPPMSG_LATENCY_HPP_
+#define INCLUDE_LUACPPMSG_LATENCY_HPP_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace LuaCppMsg
+{
+
+/**
+ * Clock for latency timestamps reading `std::chrono::steady_clock`.
+ *
+ * Precise, and typically a vDSO call costing tens of nanoseconds.
+ */
+struct SteadyClock
+{
+	static std::uint64_t now ()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()
+		).count();
+	}
+
+	static double to_ns (std::uint64_t ticks_)
+	{
+		return double(ticks_);
+	}
+};
+
+
+/**
+ * Clock for latency timestamps reading `CLOCK_MONOTONIC_COARSE` where available.
+ *
+ * Cheaper than `SteadyClock`, but only as precise as the kernel's tick (typically 1-4ms), so only
+ * suits queues whose latencies are longer than that.
+ */
+struct CoarseClock
+{
+	static std::uint64_t now ()
+	{
+		timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+		return std::uint64_t(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+	}
+
+	static double to_ns (std::uint64_t ticks_)
+	{
+		return double(ticks_);
+	}
+};
+
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * Clock for latency timestamps reading the CPU's time-stamp counter.
+ *
+ * The cheapest clock, assuming an invariant TSC synchronised across cores, as on modern x86.
+ * Ticks are converted to nanoseconds with a rate calibrated against `std::chrono::steady_clock`
+ * on first use, taking about a millisecond.
+ */
+struct TscClock
+{
+	static std::uint64_t now ()
+	{
+		return __rdtsc();
+	}
+
+	static double to_ns (std::uint64_t ticks_)
+	{
+		static const double ns_per_tick = calibrate();
+		return ticks_ * ns_per_tick;
+	}
+
+private:
+	static double calibrate ()
+	{
+		const auto start = std::chrono::steady_clock::now();
+		const std::uint64_t start_ticks = __rdtsc();
+		auto end = start;
+		while (end - start < std::chrono::milliseconds(1))
+			end = std::chrono::steady_clock::now();
+		const std::uint64_t ticks = __rdtsc() - start_ticks;
+		return std::chrono::duration<double, std::nano>(end - start).count() / ticks;
+	}
+};
+#endif
+
+
+/**
+ * A queued element with the time it was pushed, kept alongside rather than inside the message.
+ *
+ * @tparam T type of element.
+ */
+template <class T>
+struct Stamped
+{
+	/// The element.
+	T item;
+	/// When it was pushed, in ticks of the queue's clock.
+	std::uint64_t stamp;
+};
+
+
+/**
+ * Histogram of latencies in log-linear buckets, as in HdrHistogram.
+ *
+ * Values below 32ns have their own buckets, and each power of two above is split into 32, so
+ * percentiles are within about 3% of the true value.  Recording is a relaxed atomic increment,
+ * so any threads may record and query concurrently.
+ */
+class LatencyHistogram
+{
+public:
+	/**
+	 * Record a latency.
+	 *
+	 * @param ns_ latency in nanoseconds.
+	 */
+	void record (double ns_)
+	{
+		const std::uint64_t value = ns_ > 0 ? std::uint64_t(ns_) : 0;
+		m_buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		std::uint64_t max = m_max.load(std::memory_order_relaxed);
+		while (value > max &&
+			!m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+	}
+
+	/**
+	 * Get the number of latencies recorded.
+	 */
+	std::uint64_t count () const
+	{
+		return m_count.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Get the largest latency recorded.
+	 *
+	 * @return latency in nanoseconds, or 0 if none are recorded.
+	 */
+	std::uint64_t max () const
+	{
+		return m_max.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Get a percentile of the latencies recorded.
+	 *
+	 * @param percent_ percentile, from 0 to 100.
+	 * @return the highest latency in the percentile's bucket, in nanoseconds, or 0 if none are
+	 * recorded.
+	 */
+	std::uint64_t percentile (double percent_) const
+	{
+		const std::uint64_t total = count();
+		if (!total)
+			return 0;
+		std::uint64_t target = std::uint64_t(percent_ / 100 * total + 0.5);
+		if (target < 1)
+			target = 1;
+		std::uint64_t seen = 0;
+		for (std::size_t i = 0; i < NumBuckets; i++)
+		{
+			seen += m_buckets[i].load(std::memory_order_relaxed);
+			if (seen >= target)
+				return std::min(highest(i), max());
+		}
+		return max();
+	}
+
+	/**
+	 * Forget all latencies recorded.
+	 *
+	 * Latencies recorded concurrently may be partly kept.
+	 */
+	void reset ()
+	{
+		for (std::atomic<std::uint64_t>& bucket : m_buckets)
+			bucket.store(0, std::memory_order_relaxed);
+		m_count.store(0, std::memory_order_relaxed);
+		m_max.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	/// Number of bits of sub-bucket within each power of two.
+	static const unsigned SubBits = 5;
+	static const std::uint64_t SubBuckets = 1u << SubBits;
+	static const std::size_t NumBuckets = (64 - SubBits + 1) * SubBuckets;
+
+	static std::size_t bucket (std::uint64_t value_)
+	{
+		if (value_ < SubBuckets)
+			return std::size_t(value_);
+		const unsigned exponent = 63 - __builtin_clzll(value_);
+		const unsigned shift = exponent - SubBits;
+		return (shift + 1) * SubBuckets + ((value_ >> shift) & (SubBuckets - 1));
+	}
+
+	static std::uint64_t highest (std::size_t bucket_)
+	{
+		if (bucket_ < SubBuckets)
+			return bucket_;
+		const unsigned shift = unsigned(bucket_ / SubBuckets) - 1;
+		const std::uint64_t lowest = (SubBuckets + bucket_ % SubBuckets) << shift;
+		return lowest + ((std::uint64_t(1) << shift) - 1);
+	}
+
+	std::array<std::atomic<std::uint64_t>, NumBuckets> m_buckets{};
+	std::atomic<std::uint64_t> m_count{0};
+	std::atomic<std::uint64_t> m_max{0};
+};
+
+
+/**
+ * Stand-in for `LatencyHistogram` on queues that don't timestamp messages: records nothing.
+ */
+struct NoLatency
+{
+	void record (double) {}
+	std::uint64_t count () const { return 0; }
+	std::uint64_t max () const { return 0; }
+	std::uint64_t percentile (double) const { return 0; }
+	void reset () {}
+};
+
+} /* namespace LuaCppMsg */
+
+#endif /* INCLUDE_LUACPPMSG_LATENCY_HPP_ */
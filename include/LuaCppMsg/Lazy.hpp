@@ -0,0 +1,297 @@
+#ifndef INCLUDE_LUACPPMSG_LAZY_HPP_
+#define INCLUDE_LUACPPMSG_LAZY_HPP_
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
+#include <string>
+#include <typeinfo>
+#include <utility>
+#include <boost/optional.hpp>
+#include <boost/utility/string_view.hpp>
+#include <boost/variant.hpp>
+#include <LuaContext.hpp>
+#include <LuaCppMsg/Owned.hpp>
+
+namespace LuaCppMsg
+{
+
+/**
+ * A popped message, or a Map or Vec within one, handed to Lua as a proxy that converts only the
+ * fields that are read.
+ *
+ * @tparam TMsg message type, e.g. `Queue::Msg`.
+ */
+template <class TMsg>
+struct Lazy
+{
+	/// The whole popped item, kept alive by the proxies of all Maps and Vecs within it.
+	std::shared_ptr<typename TMsg::Item> root;
+	/// The item represented, within `root`.
+	const typename TMsg::Item* node;
+};
+
+} /* namespace LuaCppMsg */
+
+
+/**
+ * Push a `Lazy` message to Lua: a Map or Vec as a read-only userdata proxy, anything else
+ * converted as usual.
+ *
+ * From Lua, `msg.key` and `msg[i]` convert a single field on first access, with Maps and Vecs
+ * within it becoming proxies in turn, and cache it so repeated reads return the same value.
+ * `#msg` gets the length of a Vec, or the border of a Map's integer keys.  `msg:pairs()` iterates
+ * over the entries on any Lua version, as does `pairs(msg)` where the Lua version honours
+ * `__pairs` (not Lua 5.1 or LuaJIT without 5.2 compatibility).  `msg:totable()` converts the whole
+ * (sub)message to tables, as `pop` would.  The methods are shadowed by fields of the same name.
+ * Calling them on anything but a proxy (e.g. `msg.totable()`) raises a Lua error.
+ */
+template <class TMsg>
+struct LuaContext::Pusher<LuaCppMsg::Lazy<TMsg>>
+{
+	static const int minSize = 1;
+	static const int maxSize = 1;
+
+	static PushedObject push(lua_State* state, LuaCppMsg::Lazy<TMsg> value) noexcept
+	{
+		const Item& node = *value.node;
+		if (!boost::get<Map>(&node) && !boost::get<Vec>(&node))
+		{
+			// A leaf: convert it, consuming it if nothing else can refer to it.
+			if (value.node == value.root.get() && value.root.use_count() == 1)
+				return Pusher<LuaCppMsg::Owned<Item>>::push(state, std::move(*value.root));
+			return Pusher<LuaCppMsg::Owned<Item>>::push(state, Item(node));
+		}
+
+		new (lua_newuserdata(state, sizeof(Proxy))) Proxy{ std::move(value), LUA_NOREF };
+		if (luaL_newmetatable(state, name()))
+		{
+			lua_pushlightuserdata(
+				state, const_cast<std::type_info*>(&typeid(LuaCppMsg::Lazy<TMsg>))
+			);
+			lua_setfield(state, -2, "_typeid");
+			lua_pushcfunction(state, &gc);
+			lua_setfield(state, -2, "__gc");
+			lua_pushcfunction(state, &index);
+			lua_setfield(state, -2, "__index");
+			lua_pushcfunction(state, &len);
+			lua_setfield(state, -2, "__len");
+			lua_pushcfunction(state, &pairs);
+			lua_setfield(state, -2, "__pairs");
+		}
+		lua_setmetatable(state, -2);
+		return PushedObject{state, 1};
+	}
+
+private:
+	using Item = typename TMsg::Item;
+	using Map = typename TMsg::Map;
+	using Vec = typename TMsg::Vec;
+	using Key = typename TMsg::Key;
+	using Int = typename TMsg::Int;
+	using Str = typename TMsg::Str;
+
+	/// Contents of a proxy userdata.
+	struct Proxy
+	{
+		/// The Map or Vec represented.
+		LuaCppMsg::Lazy<TMsg> lazy;
+		/// Registry reference to the table of fields converted so far, or `LUA_NOREF`.
+		int cache;
+	};
+
+	/**
+	 * Name of the proxies' metatable in the registry.
+	 */
+	static const char* name()
+	{
+		static const std::string name = std::string("LuaCppMsg.Lazy.") + typeid(TMsg).name();
+		return name.c_str();
+	}
+
+	/**
+	 * Get the proxy that is the first argument, raising a Lua error if it isn't one.
+	 */
+	static Proxy& self(lua_State* state)
+	{
+		return *static_cast<Proxy*>(luaL_checkudata(state, 1, name()));
+	}
+
+	static int gc(lua_State* state)
+	{
+		Proxy& proxy = self(state);
+		luaL_unref(state, LUA_REGISTRYINDEX, proxy.cache);
+		proxy.~Proxy();
+		return 0;
+	}
+
+	/**
+	 * Find the item with the key at stack index `key`, or `nullptr` if there is none.
+	 */
+	static const Item* find(lua_State* state, const Proxy& proxy, int key)
+	{
+		if (lua_type(state, key) == LUA_TSTRING)
+		{
+			std::size_t size;
+			const char* chars = lua_tolstring(state, key, &size);
+			return TMsg::find(*proxy.lazy.node, boost::string_view(chars, size));
+		}
+		Int num;
+		if (lua_type(state, key) == LUA_TNUMBER && int_key(state, key, num))
+			return TMsg::find(*proxy.lazy.node, num);
+		return nullptr;
+	}
+
+	/**
+	 * Read the number at stack index `key` as an `Int`.
+	 *
+	 * @return whether it is an integer within `Int`'s range.  If not, `out` is unchanged.
+	 */
+	static bool int_key(lua_State* state, int key, Int& out)
+	{
+		const lua_Number num = lua_tonumber(state, key);
+		if (num != std::floor(num) || num < static_cast<lua_Number>(std::numeric_limits<Int>::min())
+			|| num > static_cast<lua_Number>(std::numeric_limits<Int>::max()))
+			return false;
+		out = static_cast<Int>(num);
+		return true;
+	}
+
+	/**
+	 * Push the field with the key at stack index `key`, converting and caching it on first
+	 * access.
+	 *
+	 * @return whether there is such a field.  If not, nothing is pushed.
+	 */
+	static bool push_field(lua_State* state, Proxy& proxy, int key)
+	{
+		if (proxy.cache != LUA_NOREF)
+		{
+			lua_rawgeti(state, LUA_REGISTRYINDEX, proxy.cache);
+			lua_pushvalue(state, key);
+			lua_rawget(state, -2);
+			lua_remove(state, -2);
+			if (!lua_isnil(state, -1))
+				return true;
+			lua_pop(state, 1);
+		}
+
+		const Item* field = find(state, proxy, key);
+		if (!field)
+			return false;
+		push(state, LuaCppMsg::Lazy<TMsg>{ proxy.lazy.root, field }).release();
+
+		if (proxy.cache == LUA_NOREF)
+		{
+			lua_newtable(state);
+			proxy.cache = luaL_ref(state, LUA_REGISTRYINDEX);
+		}
+		lua_rawgeti(state, LUA_REGISTRYINDEX, proxy.cache);
+		lua_pushvalue(state, key);
+		lua_pushvalue(state, -3);
+		lua_rawset(state, -3);
+		lua_pop(state, 1);
+		return true;
+	}
+
+	static int index(lua_State* state)
+	{
+		if (push_field(state, self(state), 2))
+			return 1;
+		const char* method = lua_type(state, 2) == LUA_TSTRING ? lua_tostring(state, 2) : "";
+		if (!std::strcmp(method, "totable"))
+			lua_pushcfunction(state, &totable);
+		else if (!std::strcmp(method, "pairs"))
+			lua_pushcfunction(state, &pairs);
+		else
+			lua_pushnil(state);
+		return 1;
+	}
+
+	static int len(lua_State* state)
+	{
+		const Item& node = *self(state).lazy.node;
+		std::size_t size = 0;
+		if (const Vec* vec = boost::get<Vec>(&node))
+			size = vec->size();
+		else
+			while (TMsg::find(node, static_cast<Int>(size + 1)))
+				size++;
+		lua_pushnumber(state, static_cast<lua_Number>(size));
+		return 1;
+	}
+
+	static int totable(lua_State* state)
+	{
+		Pusher<LuaCppMsg::Owned<Item>>::push(state, Item(*self(state).lazy.node)).release();
+		return 1;
+	}
+
+	static int pairs(lua_State* state)
+	{
+		self(state);
+		lua_pushcfunction(state, &next);
+		lua_pushvalue(state, 1);
+		lua_pushnil(state);
+		return 3;
+	}
+
+	/**
+	 * Iterator function for `pairs`, getting the entry after the key at stack index 2.
+	 */
+	static int next(lua_State* state)
+	{
+		Proxy& proxy = self(state);
+		lua_settop(state, 2);
+		if (const Vec* vec = boost::get<Vec>(proxy.lazy.node))
+		{
+			Int idx = 0;
+			if (!lua_isnil(state, 2) && !int_key(state, 2, idx))
+				return 0;
+			if (idx < 0 || static_cast<std::size_t>(idx) >= vec->size())
+				return 0;
+			lua_pushnumber(state, static_cast<lua_Number>(idx + 1));
+		}
+		else
+		{
+			const Map& map = boost::get<Map>(*proxy.lazy.node);
+			auto it = map.begin();
+			if (!lua_isnil(state, 2))
+			{
+				const boost::optional<Key> key = lua_key(state, 2);
+				it = key ? map.find(*key) : map.end();
+				if (it != map.end())
+					++it;
+			}
+			if (it == map.end())
+				return 0;
+			Pusher<Key>::push(state, it->first).release();
+		}
+		push_field(state, proxy, 3);
+		return 2;
+	}
+
+	/**
+	 * Read the key at a stack index as a `Key`, for iterating, or none if no `Key` can equal it.
+	 */
+	static boost::optional<Key> lua_key(lua_State* state, int key)
+	{
+		if (lua_type(state, key) == LUA_TNUMBER)
+		{
+			Int num;
+			if (!int_key(state, key, num))
+				return boost::none;
+			return Key(num);
+		}
+		if (lua_type(state, key) != LUA_TSTRING)
+			return boost::none;
+		std::size_t size;
+		const char* chars = lua_tolstring(state, key, &size);
+		return Key(Str(chars, size));
+	}
+};
+
+#endif /* INCLUDE_LUACPPMSG_LAZY_HPP_ */
@@ -0,0 +1,573 @@
+#ifndef INCLUDE_LUACPPMSG_OWNED_HPP_
+#define INCLUDE_LUACPPMSG_OWNED_HPP_
+
+#include <cmath>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/mpl/count_if.hpp>
+#include <boost/mpl/for_each.hpp>
+#include <boost/type_traits/add_pointer.hpp>
+#include <boost/variant.hpp>
+#include <LuaContext.hpp>
+#include <LuaCppMsg/Compat.hpp>
+#include <LuaCppMsg/FlatMap.hpp>
+#include <LuaCppMsg/Schema.hpp>
+
+namespace LuaCppMsg
+{
+
+/**
+ * A value passed between Lua and the queue that the receiver may move from.
+ *
+ * "luawrapper" reads each argument into a temporary and only hands it over by const reference,
+ * so taking an argument by value costs a second deep copy.  Taking an `Owned` instead allows the
+ * temporary itself to be moved into the queue.
+ *
+ * Likewise, "luawrapper" pushes variants by copying each alternative.  Returning an `Owned`
+ * instead converts the value to Lua straight from the moved-out storage.
+ *
+ * @tparam T type of value.
+ */
+template <class T>
+struct Owned
+{
+	/// The value.  Mutable so it can be moved out of a const reference.
+	mutable T value;
+};
+
+} /* namespace LuaCppMsg */
+
+
+/**
+ * Read an `Owned` value, switching on the Lua type rather than trying each alternative in turn.
+ *
+ * "luawrapper" reads a variant by attempting a full read of every alternative in order, and
+ * copies each nested map as it goes.  Here the Lua type of the value, and the `_typeid` of a
+ * userdata's metatable, are looked up once and the first alternative of a matching kind is read
+ * directly:
+ *
+ * - booleans as `bool`;
+ * - numbers as the first arithmetic or enum alternative, otherwise as a string;
+ * - strings as `std::string`;
+ * - non-empty tables whose keys are exactly 1..n as `std::vector`, if there is such an
+ *   alternative, otherwise tables as the map alternative, converting keys and values
+ *   recursively in place;
+ * - userdata as the class or pointer alternative with the same `_typeid`, and tables tagged with
+ *   a schema'd struct's metatable (see `LUACPPMSG_SCHEMA`) as that struct.
+ *
+ * Values matching no alternative are left to "luawrapper"'s reader.  Unlike "luawrapper", strings
+ * that look like numbers are kept as strings, and string keys are read with their length, so keep
+ * any embedded zeros.
+ */
+template <class T>
+struct LuaContext::Reader<LuaCppMsg::Owned<T>>
+{
+	static auto read(lua_State* state, int index)
+		-> boost::optional<LuaCppMsg::Owned<T>>
+	{
+		auto value = read_value(state, index);
+		if (!value)
+			return boost::none;
+		return LuaCppMsg::Owned<T>{ std::move(*value) };
+	}
+
+	/**
+	 * Read the value directly, as for an `Owned` value.
+	 */
+	static auto read_value(lua_State* state, int index)
+		-> boost::optional<T>
+	{
+		return read_as(state, index, static_cast<T*>(nullptr));
+	}
+
+private:
+	/// Pseudo Lua type of a table that is a sequence, for matching `std::vector` alternatives.
+	static const int LuaSequence = LUA_TTABLE + 0x100;
+
+	template <class TType>
+	struct IsTable : std::false_type {};
+
+	template <class TKey, class TValue, class THasher>
+	struct IsTable<std::unordered_map<TKey, TValue, THasher>> : std::true_type {};
+
+	template <class TKey, class TValue, class TCompare>
+	struct IsTable<LuaCppMsg::FlatMap<TKey, TValue, TCompare>> : std::true_type {};
+
+	template <class TType>
+	struct IsSequence : std::false_type {};
+
+	template <class TValue, class TAllocator>
+	struct IsSequence<std::vector<TValue, TAllocator>> : std::true_type {};
+
+	/**
+	 * Get the Lua type an alternative is read from.
+	 */
+	template <class TType>
+	static int lua_type_of() noexcept
+	{
+		return std::is_same<TType, bool>::value ? LUA_TBOOLEAN
+			: std::is_arithmetic<TType>::value || std::is_enum<TType>::value ? LUA_TNUMBER
+			: std::is_same<TType, std::string>::value ? LUA_TSTRING
+			: IsTable<TType>::value || LuaCppMsg::IsSchema<TType>::value ? LUA_TTABLE
+			: IsSequence<TType>::value ? LuaSequence
+			: std::is_class<TType>::value || std::is_pointer<TType>::value ? LUA_TUSERDATA
+			: LUA_TNONE;
+	}
+
+	/// Visitor over the alternatives of a variant, reading the first that matches the Lua value.
+	template <class TVariant>
+	struct AlternativeReader
+	{
+		template <class TType>
+		void operator()(TType*)
+		{
+			if (matched)
+				return;
+			const int expected = lua_type_of<TType>();
+			if (LuaCppMsg::IsSchema<TType>::value)
+				matched = type != LUA_TUSERDATA && typeID == &typeid(TType);
+			else if (expected == LUA_TUSERDATA)
+				matched = type == LUA_TUSERDATA && typeID == &typeid(TType);
+			else
+				matched = expected == type || (expected == LUA_TSTRING && type == LUA_TNUMBER);
+			if (!matched)
+				return;
+
+			if (expected == LUA_TUSERDATA)
+				out = TVariant{ *static_cast<TType*>(lua_touserdata(state, index)) };
+			else if (auto value = read_as(state, index, static_cast<TType*>(nullptr)))
+				out = TVariant{ std::move(*value) };
+		}
+
+		lua_State* state;
+		int index;
+		int type;
+		const std::type_info* typeID;
+		bool& matched;
+		boost::optional<TVariant>& out;
+	};
+
+	/**
+	 * Check whether a table's keys are exactly the integers 1..n, for some n > 0.
+	 */
+	static bool is_sequence(lua_State* state, int index)
+	{
+		index = LuaCppMsg::abs_index(state, index);
+		const std::size_t size = LuaCppMsg::raw_len(state, index);
+		if (!size)
+			return false;
+
+		// Distinct integer keys in 1..n, n of them, must be exactly 1..n.
+		std::size_t num = 0;
+		lua_pushnil(state);
+		while (lua_next(state, index) != 0)
+		{
+			lua_pop(state, 1);
+			if (lua_type(state, -1) != LUA_TNUMBER)
+			{
+				lua_pop(state, 1);
+				return false;
+			}
+			const lua_Number key = lua_tonumber(state, -1);
+			if (key < 1 || key > size || key != std::floor(key))
+			{
+				lua_pop(state, 1);
+				return false;
+			}
+			num++;
+		}
+		return num == size;
+	}
+
+	/**
+	 * Get the `_typeid` of a userdata's metatable, or `nullptr` if it has none.
+	 */
+	static const std::type_info* typeid_of(lua_State* state, int index)
+	{
+		if (!lua_getmetatable(state, index))
+			return nullptr;
+		lua_pushstring(state, "_typeid");
+		lua_gettable(state, -2);
+		const auto typeID = static_cast<const std::type_info*>(lua_touserdata(state, -1));
+		lua_pop(state, 2);
+		return typeID;
+	}
+
+	template <class TType>
+	static auto read_as(lua_State* state, int index, TType*)
+		-> boost::optional<TType>
+	{
+		auto value = Reader<TType>::read(state, index);
+		if (!value)
+			return boost::none;
+		return take(value);
+	}
+
+	/**
+	 * Take a value read by a "luawrapper" reader, moving it unless it refers to a userdata.
+	 */
+	template <class TType>
+	static TType take(boost::optional<TType>& value)
+	{
+		return std::move(*value);
+	}
+
+	template <class TType>
+	static TType take(boost::optional<TType&>& value)
+	{
+		return *value;
+	}
+
+	template <class... TTypes>
+	static auto read_as(lua_State* state, int index, boost::variant<TTypes...>*)
+		-> boost::optional<boost::variant<TTypes...>>
+	{
+		using Variant = boost::variant<TTypes...>;
+		const bool has_sequence = boost::mpl::count_if<
+			typename Variant::types, IsSequence<boost::mpl::_1>
+		>::value != 0;
+		const bool has_schema = boost::mpl::count_if<
+			typename Variant::types, LuaCppMsg::IsSchema<boost::mpl::_1>
+		>::value != 0;
+		int type = lua_type(state, index);
+		const std::type_info* typeID =
+			type == LUA_TUSERDATA || (type == LUA_TTABLE && has_schema)
+				? typeid_of(state, index) : nullptr;
+		if (type == LUA_TTABLE && has_sequence && is_sequence(state, index))
+			type = LuaSequence;
+
+		bool matched = false;
+		boost::optional<Variant> out;
+		boost::mpl::for_each<typename Variant::types, boost::add_pointer<boost::mpl::_1>>(
+			AlternativeReader<Variant>{ state, index, type, typeID, matched, out }
+		);
+		if (!matched)
+			return Reader<Variant>::read(state, index);
+		return out;
+	}
+
+	template <class TValue, class TAllocator>
+	static auto read_as(lua_State* state, int index, std::vector<TValue, TAllocator>*)
+		-> boost::optional<std::vector<TValue, TAllocator>>
+	{
+		if (!lua_istable(state, index))
+			return boost::none;
+		index = LuaCppMsg::abs_index(state, index);
+		const std::size_t size = LuaCppMsg::raw_len(state, index);
+		boost::optional<std::vector<TValue, TAllocator>> out;
+		out.emplace();
+		out->reserve(size);
+
+		for (std::size_t i = 1; i <= size; i++)
+		{
+			lua_rawgeti(state, index, static_cast<int>(i));
+			auto value = read_as(state, -1, static_cast<TValue*>(nullptr));
+			lua_pop(state, 1);
+			if (!value)
+				return boost::none;
+			out->push_back(std::move(*value));
+		}
+		return out;
+	}
+
+	template <class TKey, class TValue, class THasher>
+	static auto read_as(lua_State* state, int index, std::unordered_map<TKey, TValue, THasher>*)
+		-> boost::optional<std::unordered_map<TKey, TValue, THasher>>
+	{
+		using TMap = std::unordered_map<TKey, TValue, THasher>;
+		index = LuaCppMsg::abs_index(state, index);
+		boost::optional<TMap> out;
+		out.emplace();
+		out->reserve(count_entries(state, index));
+		if (!read_entries<TKey, TValue>(state, index, [&out](TKey&& key, TValue&& value) {
+				out->emplace(std::move(key), std::move(value));
+			}))
+			return boost::none;
+		return out;
+	}
+
+	/**
+	 * Read a table into a `FlatMap`, collecting its entries in `lua_next` order and sorting them
+	 * once, rather than inserting each into the sorted entries in turn.
+	 */
+	template <class TKey, class TValue, class TCompare>
+	static auto read_as(lua_State* state, int index, LuaCppMsg::FlatMap<TKey, TValue, TCompare>*)
+		-> boost::optional<LuaCppMsg::FlatMap<TKey, TValue, TCompare>>
+	{
+		using TMap = LuaCppMsg::FlatMap<TKey, TValue, TCompare>;
+		index = LuaCppMsg::abs_index(state, index);
+		std::vector<typename TMap::value_type> entries;
+		entries.reserve(count_entries(state, index));
+		if (!read_entries<TKey, TValue>(state, index, [&entries](TKey&& key, TValue&& value) {
+				entries.emplace_back(std::move(key), std::move(value));
+			}))
+			return boost::none;
+		return TMap(std::move(entries));
+	}
+
+	/**
+	 * Count a table's entries, so space for them can be reserved up front.
+	 *
+	 * @param index absolute stack index of the table.
+	 */
+	static std::size_t count_entries(lua_State* state, int index)
+	{
+		std::size_t size = 0;
+		lua_pushnil(state);
+		while (lua_next(state, index) != 0)
+		{
+			lua_pop(state, 1);
+			size++;
+		}
+		return size;
+	}
+
+	/**
+	 * Read each entry of a table, passing its key and value to `add`.
+	 *
+	 * @param index absolute stack index of the table.
+	 * @return whether every key and value could be read.
+	 */
+	template <class TKey, class TValue, class Fn>
+	static bool read_entries(lua_State* state, int index, Fn add)
+	{
+		lua_pushnil(state);
+		while (lua_next(state, index) != 0)
+		{
+			auto key = read_key(state, -2, static_cast<TKey*>(nullptr));
+			auto value = key ? read_as(state, -1, static_cast<TValue*>(nullptr)) : boost::none;
+			lua_pop(state, 1);
+			if (!value)
+			{
+				lua_pop(state, 1);
+				return false;
+			}
+			add(std::move(*key), std::move(*value));
+		}
+		return true;
+	}
+
+	/**
+	 * Read a map key.  A string key is read directly, with its length, rather than by trying
+	 * each alternative of the key type in turn.
+	 */
+	template <class TKey>
+	static auto read_key(lua_State* state, int index, TKey*)
+		-> boost::optional<TKey>
+	{
+		return read_key(
+			state, index, static_cast<TKey*>(nullptr),
+			std::is_constructible<TKey, std::string&&>{}
+		);
+	}
+
+	template <class TKey>
+	static auto read_key(lua_State* state, int index, TKey*, std::true_type)
+		-> boost::optional<TKey>
+	{
+		if (lua_type(state, index) != LUA_TSTRING)
+			return read_as(state, index, static_cast<TKey*>(nullptr));
+
+		std::size_t size;
+		const char* chars = lua_tolstring(state, index, &size);
+		return TKey(std::string(chars, size));
+	}
+
+	template <class TKey>
+	static auto read_key(lua_State* state, int index, TKey*, std::false_type)
+		-> boost::optional<TKey>
+	{
+		return read_as(state, index, static_cast<TKey*>(nullptr));
+	}
+};
+
+
+/**
+ * Push an `Owned` value to Lua, consuming it rather than copying.
+ *
+ * Variants and maps are walked in place, so no part of the value is copied before it is
+ * converted to Lua.  The value is left in a valid but unspecified state.
+ *
+ * Vectors are pushed as sequences.  Maps are pushed as tables presized for their array and hash
+ * parts and filled with raw sets, so the table is never rehashed and no metamethods run.
+ */
+template <class T>
+struct LuaContext::Pusher<LuaCppMsg::Owned<T>>
+{
+	static const int minSize = Pusher<T>::minSize;
+	static const int maxSize = Pusher<T>::maxSize;
+
+	static PushedObject push(lua_State* state, const LuaCppMsg::Owned<T>& owned) noexcept
+	{
+		return push_moved(state, std::move(owned.value));
+	}
+
+	/**
+	 * Push a value directly, consuming it as for an `Owned` value.
+	 */
+	static PushedObject push(lua_State* state, T&& value) noexcept
+	{
+		return push_moved(state, std::move(value));
+	}
+
+private:
+	/// Visitor pushing the current alternative of a variant, consuming it.
+	struct MovingWriter : public boost::static_visitor<>
+	{
+		template <class TType>
+		void operator()(TType& value) noexcept
+		{
+			obj = push_moved(state, std::move(value));
+		}
+
+		MovingWriter(lua_State* state, PushedObject& obj) : state(state), obj(obj) {}
+		lua_State* state;
+		PushedObject& obj;
+	};
+
+	/// Visitor pushing the current alternative of a (key) variant by reference.
+	struct KeyWriter : public boost::static_visitor<>
+	{
+		template <class TType>
+		void operator()(const TType& value) noexcept
+		{
+			obj = Pusher<TType>::push(state, value);
+		}
+
+		KeyWriter(lua_State* state, PushedObject& obj) : state(state), obj(obj) {}
+		lua_State* state;
+		PushedObject& obj;
+	};
+
+	template <class TType>
+	static PushedObject push_moved(lua_State* state, TType&& value) noexcept
+	{
+		return Pusher<typename std::decay<TType>::type>::push(state, std::move(value));
+	}
+
+	template <class... TTypes>
+	static PushedObject push_moved(lua_State* state, boost::variant<TTypes...>&& value) noexcept
+	{
+		PushedObject obj{state, 0};
+		MovingWriter writer{state, obj};
+		value.apply_visitor(writer);
+		return obj;
+	}
+
+	template <class TValue, class TAllocator>
+	static PushedObject push_moved(
+		lua_State* state, std::vector<TValue, TAllocator>&& value
+	) noexcept
+	{
+		lua_createtable(state, static_cast<int>(value.size()), 0);
+		for (std::size_t i = 0; i < value.size(); i++)
+		{
+			push_moved(state, std::move(value[i])).release();
+			lua_rawseti(state, -2, static_cast<int>(i) + 1);
+		}
+		return PushedObject{state, 1};
+	}
+
+	template <class TKey, class TValue, class THasher>
+	static PushedObject push_moved(
+		lua_State* state, std::unordered_map<TKey, TValue, THasher>&& value
+	) noexcept
+	{
+		return push_map(state, value);
+	}
+
+	template <class TKey, class TValue, class TCompare>
+	static PushedObject push_moved(
+		lua_State* state, LuaCppMsg::FlatMap<TKey, TValue, TCompare>&& value
+	) noexcept
+	{
+		return push_map(state, value);
+	}
+
+	template <class TMap>
+	static PushedObject push_map(lua_State* state, TMap& value) noexcept
+	{
+		// Presize the table, with positive integer keys no greater than the number of entries
+		// counted towards the array part.
+		const int size = static_cast<int>(value.size());
+		int narr = 0;
+		for (const auto& entry : value)
+		{
+			const int i = array_index(entry.first);
+			narr += i > 0 && i <= size;
+		}
+		lua_createtable(state, narr, size - narr);
+
+		for (auto& entry : value)
+		{
+			const int i = array_index(entry.first);
+			if (i > 0 && i <= size)
+			{
+				push_moved(state, std::move(entry.second)).release();
+				lua_rawseti(state, -2, i);
+			}
+			else
+			{
+				push_key(state, entry.first).release();
+				push_moved(state, std::move(entry.second)).release();
+				lua_rawset(state, -3);
+			}
+		}
+		return PushedObject{state, 1};
+	}
+
+	/// Visitor getting the integer value of a (key) variant, or 0 if it isn't integral.
+	struct ArrayIndex : public boost::static_visitor<int>
+	{
+		template <class TType>
+		int operator()(const TType& key) const noexcept
+		{
+			return array_index(key);
+		}
+	};
+
+	template <class TKey>
+	static int array_index(const TKey& key) noexcept
+	{
+		return array_index(key, std::is_integral<TKey>{});
+	}
+
+	template <class TKey>
+	static int array_index(const TKey& key, std::true_type) noexcept
+	{
+		return static_cast<int>(key);
+	}
+
+	template <class TKey>
+	static int array_index(const TKey&, std::false_type) noexcept
+	{
+		return 0;
+	}
+
+	template <class... TTypes>
+	static int array_index(const boost::variant<TTypes...>& key) noexcept
+	{
+		return boost::apply_visitor(ArrayIndex(), key);
+	}
+
+	template <class TKey>
+	static PushedObject push_key(lua_State* state, const TKey& key) noexcept
+	{
+		return Pusher<TKey>::push(state, key);
+	}
+
+	template <class... TTypes>
+	static PushedObject push_key(lua_State* state, const boost::variant<TTypes...>& key) noexcept
+	{
+		PushedObject obj{state, 0};
+		KeyWriter writer{state, obj};
+		key.apply_visitor(writer);
+		return obj;
+	}
+};
+
+#endif /* INCLUDE_LUACPPMSG_OWNED_HPP_ */
@@ -0,0 +1,121 @@
+#ifndef INCLUDE_LUACPPMSG_POLICY_HPP_
+#define INCLUDE_LUACPPMSG_POLICY_HPP_
+
+#include <cstddef>
+#include <unordered_map>
+#include <boost/functional/hash.hpp>
+#include <LuaCppMsg/FlatMap.hpp>
+#include <LuaCppMsg/Latency.hpp>
+#include <LuaCppMsg/Stats.hpp>
+#include <LuaCppMsg/Storage.hpp>
+
+namespace LuaCppMsg
+{
+
+/**
+ * Default compile-time options for a `BasicQueue` and its `BasicMessage`s.
+ *
+ * Derive from this to override individual options.
+ */
+struct DefaultPolicy
+{
+	/// Storage backend for queued items.
+	template <class T>
+	using Storage = SpinlockStorage<T>;
+
+	/// Associative container for `Map` items.
+	template <class K, class V>
+	using Map = FlatMap<K, V>;
+
+	/// Whether pushes from C++ serialise messages to a `Tape` on the producer's thread.
+	static const bool serialise_on_push = false;
+
+	/// Runtime statistics kept by the queue.
+	using Stats = NoStats;
+
+	/// Clock timestamping pushed messages for latency histograms, or `void` for none.
+	using Clock = void;
+};
+
+
+/**
+ * Options for a `BasicQueue` stored in a bounded lock-free ring buffer.
+ *
+ * @tparam N number of slots in the ring buffer, must be a power of two.
+ */
+template <std::size_t N = 4096>
+struct RingPolicy : DefaultPolicy
+{
+	/// Storage backend for queued items.
+	template <class T>
+	using Storage = RingStorage<T, N>;
+};
+
+
+/**
+ * Options for a `BasicQueue` whose `Map` items are `std::unordered_map`s.
+ *
+ * Suits messages with many keys that are looked up or inserted individually.
+ */
+struct UnorderedMapPolicy : DefaultPolicy
+{
+	/// Associative container for `Map` items.
+	template <class K, class V>
+	using Map = std::unordered_map<K, V, boost::hash<K>>;
+};
+
+
+/**
+ * Options for a `BasicQueue` whose C++ pushes serialise messages to a `Tape`.
+ *
+ * Suits queues fed by C++ threads and consumed by Lua: the Lua thread then converts each message
+ * in a single pass over its encoding.  Messages that aren't plain data are queued unchanged.
+ *
+ * @tparam Base options to otherwise use, e.g. `RingPolicy<>`.
+ */
+template <class Base = DefaultPolicy>
+struct TapePolicy : Base
+{
+	/// Whether pushes from C++ serialise messages to a `Tape` on the producer's thread.
+	static const bool serialise_on_push = true;
+};
+
+
+/**
+ * Options for a `BasicQueue` keeping runtime statistics, read with `stats()` in C++ or
+ * `lqueue:stats()` in Lua.
+ *
+ * Counters are relaxed atomics, and a spinlock storage's lock counts its acquisitions and
+ * contention.
+ *
+ * @tparam Base options to otherwise use, e.g. `RingPolicy<>`.
+ */
+template <class Base = DefaultPolicy>
+struct StatsPolicy : Base
+{
+	/// Storage backend for queued items.
+	template <class T>
+	using Storage = typename WithLock<typename Base::template Storage<T>, CountingSpinlock>::type;
+
+	/// Runtime statistics kept by the queue.
+	using Stats = AtomicStats;
+};
+
+
+/**
+ * Options for a `BasicQueue` timestamping each pushed message, and recording the latency to
+ * its pop in a histogram, read with `latency()` in C++ or `lqueue:latency(percent)` in Lua.
+ *
+ * @tparam Base options to otherwise use, e.g. `RingPolicy<>`.
+ * @tparam TClock clock to timestamp with: `SteadyClock`, `CoarseClock` or (on x86) `TscClock`.
+ */
+template <class Base = DefaultPolicy, class TClock = SteadyClock>
+struct LatencyPolicy : Base
+{
+	/// Clock timestamping pushed messages for latency histograms, or `void` for none.
+	using Clock = TClock;
+};
+
+} /* namespace LuaCppMsg */
+
+#endif /* INCLUDE_LUACPPMSG_POLICY_HPP_ */
@@ -0,0 +1,104 @@
+#ifndef INCLUDE_LUACPPMSG_READYFD_HPP_
+#define INCLUDE_LUACPPMSG_READYFD_HPP_
+
+#include <cerrno>
+#include <cstdint>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+namespace LuaCppMsg
+{
+
+/**
+ * File descriptor that is readable while a queue may have messages, for event loops (`epoll`,
+ * `poll`, `select`) to sleep on.
+ *
+ * An `eventfd` on Linux, otherwise the read end of a pipe.  Both ends are non-blocking, and
+ * signalling an already readable descriptor is harmless, so only the transition needs a write.
+ */
+class ReadyFd
+{
+public:
+	/**
+	 * Create the descriptor, initially unreadable.
+	 *
+	 * @throws std::system_error if it can't be created.
+	 */
+	ReadyFd ()
+	{
+#ifdef __linux__
+		m_read = m_write = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (m_read < 0)
+			throw std::system_error(errno, std::generic_category(), "eventfd");
+#else
+		int fds[2];
+		if (pipe(fds) < 0)
+			throw std::system_error(errno, std::generic_category(), "pipe");
+		for (int fd : fds)
+		{
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+		m_read = fds[0];
+		m_write = fds[1];
+#endif
+	}
+
+	ReadyFd (const ReadyFd&) = delete;
+	ReadyFd& operator= (const ReadyFd&) = delete;
+
+	~ReadyFd ()
+	{
+		close(m_read);
+		if (m_write != m_read)
+			close(m_write);
+	}
+
+	/**
+	 * Get the descriptor to wait on for readability.
+	 */
+	int fd () const
+	{
+		return m_read;
+	}
+
+	/**
+	 * Make the descriptor readable.
+	 */
+	void signal ()
+	{
+		const std::uint64_t one = 1;
+		while (write(m_write, &one, m_write == m_read ? sizeof(one) : 1) < 0 && errno == EINTR) {}
+	}
+
+	/**
+	 * Make the descriptor unreadable.
+	 */
+	void clear ()
+	{
+		std::uint64_t buffer[8];
+		while (true)
+		{
+			const ssize_t num = read(m_read, buffer, m_write == m_read ? sizeof(std::uint64_t)
+				: sizeof(buffer));
+			if (num < 0 && errno == EINTR)
+				continue;
+			if (num <= 0 || m_write == m_read)
+				return;
+		}
+	}
+
+private:
+	/// Descriptor to wait on.
+	int m_read;
+	/// Descriptor to write to, the same as `m_read` for an `eventfd`.
+	int m_write;
+};
+
+} /* namespace LuaCppMsg */
+
+#endif /* INCLUDE_LUACPPMSG_READYFD_HPP_ */
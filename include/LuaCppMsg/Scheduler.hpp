@@ -0,0 +1,186 @@
+#ifndef INCLUDE_LUACPPMSG_SCHEDULER_HPP_
+#define INCLUDE_LUACPPMSG_SCHEDULER_HPP_
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <poll.h>
+#include <LuaContext.hpp>
+#include <LuaCppMsg/Compat.hpp>
+
+namespace LuaCppMsg
+{
+
+/**
+ * Runs Lua coroutines that consume queues with `lqueue:recv()`, resuming each only when the
+ * queue it waits on has messages.
+ *
+ * A coroutine finding its queue empty yields the queue's `ready_fd`, and the scheduler `poll`s
+ * the descriptors of all waiting coroutines at once, so idle coroutines cost no CPU.  A coroutine
+ * yielding anything else is resumed on the next pass, without waiting.
+ *
+ * Coroutines run on the thread calling `spawn` and `run`, which must be the only one using the
+ * Lua state meanwhile.
+ */
+class Scheduler
+{
+public:
+	/**
+	 * Construct for a Lua state.
+	 *
+	 * @param L Lua state to run coroutines in.
+	 */
+	explicit Scheduler (lua_State* L)
+		: m_state(L), m_lua(new LuaContext(L))
+	{
+	}
+
+	/**
+	 * Start a coroutine running a chunk of Lua code, up to its first wait.
+	 *
+	 * @param code_ Lua code forming the coroutine's body.
+	 * @throws LuaContext::SyntaxErrorException if the code doesn't compile.
+	 * @throws LuaContext::ExecutionErrorException if the coroutine raises an error.
+	 */
+	void spawn (const std::string& code_)
+	{
+		Task task{ m_lua->createThread(), -1 };
+		if (luaL_loadbuffer(task.thread.state, code_.data(), code_.size(), "spawn"))
+			throw LuaContext::SyntaxErrorException(error_message(task.thread.state));
+		std::string error;
+		if (!resume_task(task, error))
+			m_tasks.push_back(std::move(task));
+		if (!error.empty())
+			throw LuaContext::ExecutionErrorException(error);
+	}
+
+	/**
+	 * Get the number of coroutines that haven't finished.
+	 */
+	std::size_t size () const
+	{
+		return m_tasks.size();
+	}
+
+	/**
+	 * Wait up to `timeout_` for any coroutine's queue to have messages, then resume each that
+	 * does (and each that yielded without waiting on a queue).
+	 *
+	 * @param timeout_ maximum time to wait.
+	 * @return number of coroutines that haven't finished.
+	 * @throws LuaContext::ExecutionErrorException if a coroutine raises an error, after the
+	 * others have been resumed.  The failed coroutine is discarded.
+	 */
+	template <class Rep, class Period>
+	std::size_t run_for (const std::chrono::duration<Rep, Period>& timeout_)
+	{
+		return run_once(int(std::chrono::duration_cast<std::chrono::milliseconds>(timeout_).count()));
+	}
+
+	/**
+	 * Resume coroutines as their queues have messages, until they have all finished.
+	 *
+	 * @throws LuaContext::ExecutionErrorException if a coroutine raises an error.
+	 */
+	void run ()
+	{
+		while (run_once(-1)) {}
+	}
+
+private:
+	/// A coroutine that hasn't finished.
+	struct Task
+	{
+		/// The coroutine.
+		LuaContext::ThreadID thread;
+		/// Descriptor it waits on, or -1 to resume it on the next pass.
+		int fd;
+	};
+
+	/// Lua state that coroutines are created in.
+	lua_State* m_state;
+	/// Context for creating coroutines.
+	std::shared_ptr<LuaContext> m_lua;
+	/// Coroutines that haven't finished.
+	std::vector<Task> m_tasks;
+	/// Descriptors polled, parallel to `m_tasks`, kept to avoid reallocating each pass.
+	std::vector<pollfd> m_fds;
+
+	/**
+	 * Wait for readiness and resume the ready coroutines, once.
+	 *
+	 * @param timeout_ms_ maximum time to wait in milliseconds, or -1 to wait indefinitely.
+	 * @return number of coroutines that haven't finished.
+	 */
+	std::size_t run_once (int timeout_ms_)
+	{
+		if (m_tasks.empty())
+			return 0;
+		m_fds.clear();
+		for (const Task& task : m_tasks)
+		{
+			m_fds.push_back(pollfd{ task.fd, POLLIN, 0 });
+			if (task.fd < 0)
+				timeout_ms_ = 0;
+		}
+		if (poll(m_fds.data(), m_fds.size(), timeout_ms_) < 0 && errno != EINTR)
+			throw std::system_error(errno, std::generic_category(), "poll");
+
+		std::string error;
+		std::vector<bool> finished(m_fds.size());
+		for (std::size_t i = 0; i < m_fds.size(); i++)
+			if (m_fds[i].fd < 0 || m_fds[i].revents)
+				finished[i] = resume_task(m_tasks[i], error);
+
+		std::size_t kept = 0;
+		for (std::size_t i = 0; i < m_tasks.size(); i++)
+			if (i >= finished.size() || !finished[i])
+				m_tasks[kept++] = std::move(m_tasks[i]);
+		m_tasks.erase(m_tasks.begin() + kept, m_tasks.end());
+		if (!error.empty())
+			throw LuaContext::ExecutionErrorException(error);
+		return m_tasks.size();
+	}
+
+	/**
+	 * Resume a coroutine until it next yields, and note what it waits on.
+	 *
+	 * @param task_ coroutine to resume.
+	 * @param error_ set to the error message if the coroutine raises one and none is set yet.
+	 * @return whether the coroutine has finished, or failed.
+	 */
+	bool resume_task (Task& task_, std::string& error_)
+	{
+		lua_State* thread = task_.thread.state;
+		int nresults = 0;
+		const int status = resume(thread, m_state, 0, nresults);
+		if (status == LUA_YIELD)
+		{
+			task_.fd = nresults && lua_type(thread, -1) == LUA_TNUMBER ?
+				int(lua_tointeger(thread, -1)) : -1;
+			lua_settop(thread, 0);
+			return false;
+		}
+		if (status && error_.empty())
+			error_ = error_message(thread);
+		return true;
+	}
+
+	/**
+	 * Get the error message at the top of a thread's stack.
+	 */
+	static std::string error_message (lua_State* thread_)
+	{
+		const char* message = lua_tostring(thread_, -1);
+		return message ? message : "error in coroutine";
+	}
+};
+
+} /* namespace LuaCppMsg */
+
+#endif /* INCLUDE_LUACPPMSG_SCHEDULER_HPP_ */
@@ -0,0 +1,226 @@
+#ifndef INCLUDE_LUACPPMSG_SCHEMA_HPP_
+#define INCLUDE_LUACPPMSG_SCHEMA_HPP_
+
+#include <cstddef>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <boost/preprocessor/seq/for_each.hpp>
+#include <boost/preprocessor/stringize.hpp>
+#include <boost/preprocessor/variadic/size.hpp>
+#include <boost/preprocessor/variadic/to_seq.hpp>
+#include <LuaContext.hpp>
+#include <LuaCppMsg/Compat.hpp>
+
+namespace LuaCppMsg
+{
+
+template <class T>
+struct Owned;
+
+/**
+ * Compile-time description of a message struct's fields.
+ *
+ * Specialised by `LUACPPMSG_SCHEMA`, with `size`, the number of fields, and `for_each`, calling a
+ * function with the name, name length and a reference to each field in turn.
+ *
+ * @tparam T message struct.
+ */
+template <class T>
+struct Schema
+{
+	static const bool defined = false;
+};
+
+/// Whether a type has a `Schema`.
+template <class T>
+struct IsSchema : std::integral_constant<bool, Schema<T>::defined> {};
+
+/**
+ * Push the metatable tagging tables converted from a schema'd struct, creating it if needed.
+ *
+ * The metatable's `_typeid` identifies the struct, so a tagged table pushed back to a queue is
+ * read as the struct again, rather than as a `Map`.
+ *
+ * @tparam T message struct.
+ * @param state Lua state.
+ */
+template <class T>
+void push_schema_metatable (lua_State* state)
+{
+	static const std::string name = std::string("LuaCppMsg.Schema.") + typeid(T).name();
+	if (luaL_newmetatable(state, name.c_str()))
+	{
+		lua_pushlightuserdata(state, const_cast<std::type_info*>(&typeid(T)));
+		lua_setfield(state, -2, "_typeid");
+	}
+}
+
+/**
+ * Tag a table (or a new, empty one) as a schema'd struct, as a Lua constructor.
+ *
+ * @tparam T message struct.
+ * @param state Lua state, with the table, if any, as the first argument.
+ * @return 1, the tagged table.
+ */
+template <class T>
+int construct_schema (lua_State* state)
+{
+	if (!lua_istable(state, 1))
+	{
+		lua_settop(state, 0);
+		lua_newtable(state);
+	}
+	lua_settop(state, 1);
+	push_schema_metatable<T>(state);
+	lua_setmetatable(state, 1);
+	return 1;
+}
+
+/**
+ * Expose a constructor for a schema'd struct to Lua, tagging a table of its fields.
+ *
+ * E.g. after `bind_schema<Pose>(L, "Pose")`, `lqueue:push(Pose{ id = 3, x = 1.5 })` from Lua
+ * pushes a `Pose` rather than a `Map`.
+ *
+ * @tparam T message struct.
+ * @param state Lua state.
+ * @param name_ global name of the constructor.
+ */
+template <class T>
+void bind_schema (lua_State* state, const char* name_)
+{
+	static_assert(IsSchema<T>::value, "type has no LUACPPMSG_SCHEMA");
+	lua_pushcfunction(state, &construct_schema<T>);
+	lua_setglobal(state, name_);
+}
+
+} /* namespace LuaCppMsg */
+
+
+/// @cond
+#define LUACPPMSG_SCHEMA_FIELD(r, data, field) \
+	fn_(BOOST_PP_STRINGIZE(field), sizeof(BOOST_PP_STRINGIZE(field)) - 1, obj_.field);
+/// @endcond
+
+/**
+ * Declare the fields of a message struct, so it is carried by a queue as a native struct and
+ * converted to and from a Lua table of those fields.
+ *
+ * Must be used at global namespace scope, e.g.
+ * ```
+ * struct Pose { int id; double x; std::string frame; };
+ * LUACPPMSG_SCHEMA(Pose, id, x, frame)
+ * ```
+ * The struct must be default-constructible, and its field types convertible to and from Lua.
+ *
+ * @param Type message struct.
+ * @param ... names of its fields.
+ */
+#define LUACPPMSG_SCHEMA(Type, ...) \
+	namespace LuaCppMsg \
+	{ \
+	template <> \
+	struct Schema<Type> \
+	{ \
+		static const bool defined = true; \
+		static const std::size_t size = BOOST_PP_VARIADIC_SIZE(__VA_ARGS__); \
+		template <class TObj, class Fn> \
+		static void for_each (TObj& obj_, Fn&& fn_) \
+		{ \
+			BOOST_PP_SEQ_FOR_EACH(LUACPPMSG_SCHEMA_FIELD, _, BOOST_PP_VARIADIC_TO_SEQ(__VA_ARGS__)) \
+		} \
+	}; \
+	}
+
+
+/**
+ * Push a schema'd struct to Lua as a table of its fields, tagged with its metatable.
+ *
+ * The table is presized for the fields, and each field name is pushed with its length known at
+ * compile time.
+ */
+template <class T>
+struct LuaContext::Pusher<T, typename std::enable_if<LuaCppMsg::IsSchema<T>::value>::type>
+{
+	static const int minSize = 1;
+	static const int maxSize = 1;
+
+	static PushedObject push(lua_State* state, const T& value) noexcept
+	{
+		lua_createtable(state, 0, static_cast<int>(LuaCppMsg::Schema<T>::size));
+		LuaCppMsg::Schema<T>::for_each(value, FieldWriter{ state });
+		LuaCppMsg::push_schema_metatable<T>(state);
+		lua_setmetatable(state, -2);
+		return PushedObject{state, 1};
+	}
+
+private:
+	struct FieldWriter
+	{
+		template <class TField>
+		void operator()(const char* name, std::size_t size, const TField& field) const
+		{
+			lua_pushlstring(state, name, size);
+			Pusher<TField>::push(state, field).release();
+			lua_rawset(state, -3);
+		}
+
+		lua_State* state;
+	};
+};
+
+
+/**
+ * Read a schema'd struct from a Lua table, reading only its declared fields.
+ *
+ * Fields that are `nil` keep their default value.  Fails if the value isn't a table, or a field
+ * can't be converted.
+ */
+template <class T>
+struct LuaContext::Reader<T, typename std::enable_if<LuaCppMsg::IsSchema<T>::value>::type>
+{
+	static auto read(lua_State* state, int index)
+		-> boost::optional<T>
+	{
+		if (!lua_istable(state, index))
+			return boost::none;
+
+		boost::optional<T> out;
+		out.emplace();
+		bool ok = true;
+		LuaCppMsg::Schema<T>::for_each(
+			*out, FieldReader{ state, LuaCppMsg::abs_index(state, index), ok }
+		);
+		if (!ok)
+			return boost::none;
+		return out;
+	}
+
+private:
+	struct FieldReader
+	{
+		template <class TField>
+		void operator()(const char* name, std::size_t, TField& field) const
+		{
+			if (!ok)
+				return;
+			lua_getfield(state, index, name);
+			if (!lua_isnil(state, -1))
+			{
+				auto value = Reader<LuaCppMsg::Owned<TField>>::read_value(state, -1);
+				if (value)
+					field = std::move(*value);
+				else
+					ok = false;
+			}
+			lua_pop(state, 1);
+		}
+
+		lua_State* state;
+		int index;
+		bool& ok;
+	};
+};
+
+#endif /* INCLUDE_LUACPPMSG_SCHEMA_HPP_ */
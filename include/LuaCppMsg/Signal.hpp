@@ -0,0 +1,138 @@
+#ifndef INCLUDE_LUACPPMSG_SIGNAL_HPP_
+#define INCLUDE_LUACPPMSG_SIGNAL_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace LuaCppMsg
+{
+
+/**
+ * Parking spot for threads waiting on a condition of a lock-free or spinlocked structure.
+ *
+ * Waiting threads briefly yield, then sleep on a condition variable.  Notifying is a single
+ * atomic load when no thread is asleep, so it can be called liberally on hot paths.
+ */
+class Signal
+{
+public:
+	/// Number of times to yield and recheck before going to sleep.
+	static const unsigned SpinCount = 64;
+
+	/**
+	 * Block until `ready_` returns true.
+	 *
+	 * @param ready_ predicate to (re)check after each wake-up, called with the internal mutex held
+	 * once asleep.
+	 */
+	template <class Pred>
+	void wait (Pred ready_)
+	{
+		if (spin(ready_))
+			return;
+		Waiting waiting(m_waiters);
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cond.wait(lock, ready_);
+	}
+
+	/**
+	 * Block until `ready_` returns true, or the timeout expires.
+	 *
+	 * @param ready_ predicate to (re)check after each wake-up, called with the internal mutex held
+	 * once asleep.
+	 * @param timeout_ maximum time to wait.
+	 * @return the final result of `ready_`.
+	 */
+	template <class Pred, class Rep, class Period>
+	bool wait_for (Pred ready_, const std::chrono::duration<Rep, Period>& timeout_)
+	{
+		if (spin(ready_))
+			return true;
+		Waiting waiting(m_waiters);
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return m_cond.wait_for(lock, timeout_, ready_);
+	}
+
+	/**
+	 * Wake a single waiting thread, if any.
+	 *
+	 * Must be called after the state change that may make a waiter's predicate true.
+	 */
+	void notify_one ()
+	{
+		if (waiting())
+		{
+			{ std::lock_guard<std::mutex> lock(m_mutex); }
+			m_cond.notify_one();
+		}
+	}
+
+	/**
+	 * Wake all waiting threads, if any.
+	 *
+	 * Must be called after the state change that may make a waiter's predicate true.
+	 */
+	void notify_all ()
+	{
+		if (waiting())
+		{
+			{ std::lock_guard<std::mutex> lock(m_mutex); }
+			m_cond.notify_all();
+		}
+	}
+
+private:
+	/// RAII counter of threads currently waiting.
+	struct Waiting
+	{
+		Waiting (std::atomic<unsigned>& waiters_) : m_waiters(waiters_) { m_waiters++; }
+		~Waiting () { m_waiters--; }
+		std::atomic<unsigned>& m_waiters;
+	};
+
+	/// Mutex guarding the condition variable.
+	std::mutex m_mutex;
+	/// Condition variable that waiting threads sleep on.
+	std::condition_variable m_cond;
+	/// Number of threads currently waiting.
+	std::atomic<unsigned> m_waiters{0};
+
+	/**
+	 * Yield and recheck `ready_` a bounded number of times, to avoid sleeping on short waits.
+	 *
+	 * @param ready_ predicate to check.
+	 * @return whether `ready_` returned true.
+	 */
+	template <class Pred>
+	static bool spin (Pred& ready_)
+	{
+		for (unsigned i = 0; i < SpinCount; i++)
+		{
+			std::this_thread::yield();
+			if (ready_())
+				return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Check if any thread is waiting.
+	 *
+	 * The fence orders the notifier's preceding state change before this load, pairing with the
+	 * waiter's increment of `m_waiters` before it checks its predicate.
+	 *
+	 * @return whether there are waiting threads.
+	 */
+	bool waiting ()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		return m_waiters.load(std::memory_order_relaxed) != 0;
+	}
+};
+
+} /* namespace LuaCppMsg */
+
+#endif /* INCLUDE_LUACPPMSG_SIGNAL_HPP_ */
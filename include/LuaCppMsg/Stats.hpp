@@ -0,0 +1,364 @@
+#ifndef INCLUDE_LUACPPMSG_STATS_HPP_
+#define INCLUDE_LUACPPMSG_STATS_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <boost/smart_ptr/detail/yield_k.hpp>
+#include <boost/variant.hpp>
+#include <LuaCppMsg/Blob.hpp>
+#include <LuaCppMsg/Dense.hpp>
+#include <LuaCppMsg/FlatMap.hpp>
+#include <LuaCppMsg/Schema.hpp>
+#include <LuaCppMsg/Storage.hpp>
+#include <LuaCppMsg/Tape.hpp>
+
+namespace LuaCppMsg
+{
+
+/**
+ * A snapshot of a queue's runtime statistics.
+ *
+ * Counters are totals since the queue was constructed.  With `NoStats`, only `depth` is filled
+ * in, from the storage's size.
+ */
+struct QueueStats
+{
+	/// Messages pushed.
+	std::uint64_t pushed = 0;
+	/// Messages popped.
+	std::uint64_t popped = 0;
+	/// Pushes given up because the queue was at capacity.
+	std::uint64_t rejected = 0;
+	/// Messages queued now.
+	std::uint64_t depth = 0;
+	/// Most messages queued at once.
+	std::uint64_t peak_depth = 0;
+	/// Estimated bytes queued now, from the average estimated size of pushed messages.
+	std::uint64_t bytes = 0;
+	/// Pushes that waited for space.
+	std::uint64_t push_waits = 0;
+	/// Total time pushes waited for space, in nanoseconds.
+	std::uint64_t push_wait_ns = 0;
+	/// Pops that waited for a message.
+	std::uint64_t pop_waits = 0;
+	/// Total time pops waited for a message, in nanoseconds.
+	std::uint64_t pop_wait_ns = 0;
+	/// Acquisitions of the storage's lock, if it has one.
+	std::uint64_t lock_acquisitions = 0;
+	/// Acquisitions of the storage's lock that found it held.
+	std::uint64_t lock_contentions = 0;
+	/// Times a contended acquisition spun or yielded before taking the lock.
+	std::uint64_t lock_spins = 0;
+};
+
+
+/**
+ * Statistics that are compiled out: every update is an empty inline function.
+ */
+struct NoStats
+{
+	void on_push (std::size_t, std::size_t) {}
+	void on_pop (std::size_t) {}
+	void on_reject () {}
+	void on_push_wait (std::uint64_t) {}
+	void on_pop_wait (std::uint64_t) {}
+	void read (QueueStats&) const {}
+
+	/// Whether updates are counted, so callers can skip work feeding them.
+	static const bool enabled = false;
+};
+
+
+/**
+ * Statistics kept in relaxed atomics.
+ *
+ * Producer-side and consumer-side counters are on separate cache lines, so producers don't
+ * contend with the consumer beyond the queue itself.
+ */
+class AtomicStats
+{
+public:
+	/// Whether updates are counted, so callers can skip work feeding them.
+	static const bool enabled = true;
+
+	/**
+	 * Count messages pushed.
+	 *
+	 * @param num_ number of messages.
+	 * @param bytes_ their estimated size.
+	 */
+	void on_push (std::size_t num_, std::size_t bytes_)
+	{
+		const std::uint64_t pushed = m_pushed.fetch_add(num_, std::memory_order_relaxed) + num_;
+		m_pushed_bytes.fetch_add(bytes_, std::memory_order_relaxed);
+		const std::uint64_t popped = m_popped.load(std::memory_order_relaxed);
+		const std::uint64_t depth = pushed > popped ? pushed - popped : 0;
+		std::uint64_t peak = m_peak_depth.load(std::memory_order_relaxed);
+		while (depth > peak &&
+			!m_peak_depth.compare_exchange_weak(peak, depth, std::memory_order_relaxed)) {}
+	}
+
+	/**
+	 * Count messages popped.
+	 *
+	 * @param num_ number of messages.
+	 */
+	void on_pop (std::size_t num_)
+	{
+		m_popped.fetch_add(num_, std::memory_order_relaxed);
+	}
+
+	/**
+	 * Count a push given up because the queue was at capacity.
+	 */
+	void on_reject ()
+	{
+		m_rejected.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	/**
+	 * Count a push that waited for space.
+	 *
+	 * @param ns_ time waited, in nanoseconds.
+	 */
+	void on_push_wait (std::uint64_t ns_)
+	{
+		m_push_waits.fetch_add(1, std::memory_order_relaxed);
+		m_push_wait_ns.fetch_add(ns_, std::memory_order_relaxed);
+	}
+
+	/**
+	 * Count a pop that waited for a message.
+	 *
+	 * @param ns_ time waited, in nanoseconds.
+	 */
+	void on_pop_wait (std::uint64_t ns_)
+	{
+		m_pop_waits.fetch_add(1, std::memory_order_relaxed);
+		m_pop_wait_ns.fetch_add(ns_, std::memory_order_relaxed);
+	}
+
+	/**
+	 * Copy the counters into a snapshot, including the depth they imply.
+	 *
+	 * @param stats_ snapshot to fill in.
+	 */
+	void read (QueueStats& stats_) const
+	{
+		stats_.popped = m_popped.load(std::memory_order_relaxed);
+		stats_.pushed = m_pushed.load(std::memory_order_relaxed);
+		stats_.depth = stats_.pushed > stats_.popped ? stats_.pushed - stats_.popped : 0;
+		stats_.rejected = m_rejected.load(std::memory_order_relaxed);
+		stats_.peak_depth = m_peak_depth.load(std::memory_order_relaxed);
+		if (stats_.pushed)
+			stats_.bytes =
+				m_pushed_bytes.load(std::memory_order_relaxed) / stats_.pushed * stats_.depth;
+		stats_.push_waits = m_push_waits.load(std::memory_order_relaxed);
+		stats_.push_wait_ns = m_push_wait_ns.load(std::memory_order_relaxed);
+		stats_.pop_waits = m_pop_waits.load(std::memory_order_relaxed);
+		stats_.pop_wait_ns = m_pop_wait_ns.load(std::memory_order_relaxed);
+	}
+
+private:
+	alignas(CacheLine) std::atomic<std::uint64_t> m_pushed{0};
+	std::atomic<std::uint64_t> m_pushed_bytes{0};
+	std::atomic<std::uint64_t> m_peak_depth{0};
+	std::atomic<std::uint64_t> m_rejected{0};
+	std::atomic<std::uint64_t> m_push_waits{0};
+	std::atomic<std::uint64_t> m_push_wait_ns{0};
+	alignas(CacheLine) std::atomic<std::uint64_t> m_popped{0};
+	std::atomic<std::uint64_t> m_pop_waits{0};
+	std::atomic<std::uint64_t> m_pop_wait_ns{0};
+};
+
+
+/**
+ * A `Spinlock` counting its acquisitions, and how often and how long they were contended.
+ */
+class CountingSpinlock
+{
+public:
+	void lock ()
+	{
+		m_acquisitions.fetch_add(1, std::memory_order_relaxed);
+		if (m_lock.try_lock())
+			return;
+		unsigned k = 0;
+		do
+			boost::detail::yield(k++);
+		while (!m_lock.try_lock());
+		m_contentions.fetch_add(1, std::memory_order_relaxed);
+		m_spins.fetch_add(k, std::memory_order_relaxed);
+	}
+
+	bool try_lock ()
+	{
+		if (!m_lock.try_lock())
+			return false;
+		m_acquisitions.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	void unlock ()
+	{
+		m_lock.unlock();
+	}
+
+	/**
+	 * Copy the counters into a snapshot.
+	 *
+	 * @param stats_ snapshot to fill in.
+	 */
+	void read (QueueStats& stats_) const
+	{
+		stats_.lock_acquisitions = m_acquisitions.load(std::memory_order_relaxed);
+		stats_.lock_contentions = m_contentions.load(std::memory_order_relaxed);
+		stats_.lock_spins = m_spins.load(std::memory_order_relaxed);
+	}
+
+private:
+	Spinlock m_lock;
+	std::atomic<std::uint64_t> m_acquisitions{0};
+	std::atomic<std::uint64_t> m_contentions{0};
+	std::atomic<std::uint64_t> m_spins{0};
+};
+
+
+/**
+ * Swap a storage backend's lock for another, if it has one.
+ *
+ * @tparam TStorage storage backend.
+ * @tparam TLock lock to use instead.
+ */
+template <class TStorage, class TLock>
+struct WithLock
+{
+	using type = TStorage;
+};
+
+template <class T, class TOldLock, class TLock>
+struct WithLock<SpinlockStorage<T, TOldLock>, TLock>
+{
+	using type = SpinlockStorage<T, TLock>;
+};
+
+
+/**
+ * Copy a storage backend's lock counters into a snapshot, if it counts them.
+ */
+template <class TStorage>
+void read_lock_stats (const TStorage&, QueueStats&) {}
+
+template <class T>
+void read_lock_stats (const SpinlockStorage<T, CountingSpinlock>& storage_, QueueStats& stats_)
+{
+	storage_.lock().read(stats_);
+}
+
+
+template <class... Ts>
+std::size_t estimate_bytes (const boost::variant<Ts...>& value_);
+
+/**
+ * Estimate the memory used by a message item, beyond the item itself.
+ *
+ * Counts string and buffer contents and container elements, not allocator overheads.
+ */
+template <class T>
+std::size_t estimate_bytes (const T&)
+{
+	return 0;
+}
+
+inline std::size_t estimate_bytes (const std::string& value_)
+{
+	return value_.size();
+}
+
+inline std::size_t estimate_bytes (const Blob& value_)
+{
+	return value_.size();
+}
+
+inline std::size_t estimate_bytes (const Dense& value_)
+{
+	return value_.size() * value_.element_size();
+}
+
+inline std::size_t estimate_bytes (const Tape& value_)
+{
+	return value_.bytes().size();
+}
+
+template <class T, class A>
+std::size_t estimate_bytes (const std::vector<T, A>& value_)
+{
+	std::size_t bytes = value_.size() * sizeof(T);
+	for (const T& elem : value_)
+		bytes += estimate_bytes(elem);
+	return bytes;
+}
+
+template <class TMap>
+std::size_t estimate_map_bytes (const TMap& map_)
+{
+	std::size_t bytes = map_.size() * sizeof(typename TMap::value_type);
+	for (const auto& entry : map_)
+		bytes += estimate_bytes(entry.first) + estimate_bytes(entry.second);
+	return bytes;
+}
+
+template <class K, class V, class C>
+std::size_t estimate_bytes (const FlatMap<K, V, C>& value_)
+{
+	return estimate_map_bytes(value_);
+}
+
+template <class K, class V, class H>
+std::size_t estimate_bytes (const std::unordered_map<K, V, H>& value_)
+{
+	return estimate_map_bytes(value_);
+}
+
+template <class T>
+std::size_t estimate_bytes (const boost::recursive_wrapper<T>& value_)
+{
+	return sizeof(T) + estimate_bytes(value_.get());
+}
+
+/// @cond
+namespace detail
+{
+
+struct ByteSize : public boost::static_visitor<std::size_t>
+{
+	template <class T>
+	std::size_t operator()(const T& value) const
+	{
+		return estimate_bytes(value);
+	}
+};
+
+} /* namespace detail */
+/// @endcond
+
+template <class... Ts>
+std::size_t estimate_bytes (const boost::variant<Ts...>& value_)
+{
+	return boost::apply_visitor(detail::ByteSize(), value_);
+}
+
+} /* namespace LuaCppMsg */
+
+
+/// Pushed to Lua by `lqueue:stats()` as a table of the counters.
+LUACPPMSG_SCHEMA(LuaCppMsg::QueueStats,
+	pushed, popped, rejected, depth, peak_depth, bytes, push_waits, push_wait_ns, pop_waits,
+	pop_wait_ns, lock_acquisitions, lock_contentions, lock_spins)
+
+#endif /* INCLUDE_LUACPPMSG_STATS_HPP_ */
@@ -0,0 +1,583 @@
+#ifndef INCLUDE_LUACPPMSG_STORAGE_HPP_
+#define INCLUDE_LUACPPMSG_STORAGE_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <boost/smart_ptr/detail/spinlock.hpp>
+#include <boost/optional.hpp>
+
+namespace LuaCppMsg
+{
+
+/// Assumed size of a cache line, used to pad contended members apart.
+static const std::size_t CacheLine = 64;
+
+/**
+ * A spinlock, constructed unlocked.
+ */
+class Spinlock
+{
+public:
+	void lock ()
+	{
+		m_lock.lock();
+	}
+
+	bool try_lock ()
+	{
+		return m_lock.try_lock();
+	}
+
+	void unlock ()
+	{
+		m_lock.unlock();
+	}
+
+private:
+	boost::detail::spinlock m_lock = BOOST_DETAIL_SPINLOCK_INIT;
+};
+
+
+/**
+ * Storage backend of a singly-linked list of nodes guarded by a single spinlock.
+ *
+ * This is the original `Queue` storage and remains the default.  Unbounded unless a capacity
+ * is set.
+ *
+ * Nodes are allocated and their elements moved in before the lock is taken, and elements are
+ * moved out and nodes freed after it is released, so the critical section only relinks
+ * pointers.
+ *
+ * @tparam T type of element stored.
+ * @tparam Lock lock type, e.g. `CountingSpinlock` to gather statistics.
+ */
+template <class T, class Lock = Spinlock>
+class SpinlockStorage
+{
+public:
+	SpinlockStorage () = default;
+	SpinlockStorage (const SpinlockStorage&) = delete;
+	SpinlockStorage& operator= (const SpinlockStorage&) = delete;
+
+	/**
+	 * Free any elements remaining in the storage.
+	 */
+	~SpinlockStorage ()
+	{
+		free_nodes(m_head);
+	}
+
+	/**
+	 * Thread-safely append an element.
+	 *
+	 * @param item_ element to append, moved from on success.
+	 * @return whether the element was appended, `false` if the storage is at capacity.
+	 */
+	bool try_push (T&& item_)
+	{
+		bool was_empty;
+		return try_push(std::move(item_), was_empty);
+	}
+
+	/**
+	 * Thread-safely append an element, reporting whether the storage was empty beforehand.
+	 *
+	 * @param item_ element to append, moved from on success.
+	 * @param was_empty_ set to whether the storage was empty before the element was appended.
+	 * @return whether the element was appended, `false` if the storage is at capacity.
+	 */
+	bool try_push (T&& item_, bool& was_empty_)
+	{
+		std::unique_ptr<Node> node(new Node{std::move(item_), nullptr});
+		{
+			std::lock_guard<Lock> lock(m_lock);
+			if (!m_capacity || m_size < m_capacity)
+			{
+				was_empty_ = !m_size;
+				link(node.get(), node.get(), 1);
+				node.release();
+				return true;
+			}
+		}
+		item_ = std::move(node->item);
+		return false;
+	}
+
+	/**
+	 * Thread-safely append a range of elements under a single lock acquisition.
+	 *
+	 * Appends as many elements as capacity allows, from the front of the range.  The whole
+	 * range is linked with constant work under the lock, unless it doesn't fit.
+	 *
+	 * @param first_ iterator to first element to append, elements are moved from.
+	 * @param last_ iterator past last element to append.
+	 * @param was_empty_ set to whether the storage was empty before the elements were appended.
+	 * @return number of elements appended.
+	 */
+	template <class It>
+	std::size_t try_push_bulk (It first_, It last_, bool& was_empty_)
+	{
+		if (first_ == last_)
+			return 0;
+
+		// Build the chain outside the lock.
+		Node* first = new Node{std::move(*first_), nullptr};
+		Node* last = first;
+		std::size_t num = 1;
+		for (It it = std::next(first_); it != last_; ++it, ++num)
+			last = last->next = new Node{std::move(*it), nullptr};
+
+		std::size_t num_linked = num;
+		Node* rest = nullptr;
+		{
+			std::lock_guard<Lock> lock(m_lock);
+			was_empty_ = !m_size;
+			const std::size_t capacity = m_capacity;
+			if (capacity && m_size + num > capacity)
+			{
+				num_linked = m_size < capacity ? capacity - m_size : 0;
+				if (!num_linked)
+					rest = first;
+				else
+				{
+					last = first;
+					for (std::size_t i = 1; i < num_linked; i++)
+						last = last->next;
+					rest = last->next;
+					last->next = nullptr;
+				}
+			}
+			if (num_linked)
+				link(first, last, num_linked);
+		}
+
+		// Hand back elements that didn't fit.
+		std::advance(first_, num_linked);
+		for (Node* node = rest; node; ++first_)
+		{
+			*first_ = std::move(node->item);
+			Node* next = node->next;
+			delete node;
+			node = next;
+		}
+		return num_linked;
+	}
+
+	/**
+	 * Thread-safely remove up to `max_` elements from the front under a single lock acquisition.
+	 *
+	 * @param out_ output iterator to move removed elements to.
+	 * @param max_ maximum number of elements to remove.
+	 * @return number of elements removed.
+	 */
+	template <class OutIt>
+	std::size_t try_pop_bulk (OutIt out_, std::size_t max_)
+	{
+		Node* first;
+		std::size_t num;
+		{
+			std::lock_guard<Lock> lock(m_lock);
+			num = std::min(max_, m_size);
+			first = unlink(num);
+		}
+
+		while (first)
+		{
+			*out_++ = std::move(first->item);
+			Node* next = first->next;
+			delete first;
+			first = next;
+		}
+		return num;
+	}
+
+	/**
+	 * Thread-safely remove the element at the front.
+	 *
+	 * @return the element, or `boost::none` if empty.
+	 */
+	boost::optional<T> try_pop ()
+	{
+		Node* node;
+		{
+			std::lock_guard<Lock> lock(m_lock);
+			node = unlink(m_size ? 1 : 0);
+		}
+		if (!node)
+			return boost::none;
+		std::unique_ptr<Node> owner(node);
+		return boost::optional<T>(std::move(node->item));
+	}
+
+	/**
+	 * Thread-safely get number of elements stored.
+	 *
+	 * @return number of elements.
+	 */
+	std::size_t size ()
+	{
+		std::lock_guard<Lock> lock(m_lock);
+		return m_size;
+	}
+
+	/**
+	 * Get maximum number of elements that can be stored.
+	 *
+	 * @return capacity, or 0 if unbounded.
+	 */
+	std::size_t capacity () const
+	{
+		return m_capacity;
+	}
+
+	/**
+	 * Set maximum number of elements that can be stored.
+	 *
+	 * Elements already stored beyond a reduced capacity are kept.
+	 *
+	 * @param capacity_ new capacity, or 0 for unbounded.
+	 */
+	void set_capacity (std::size_t capacity_)
+	{
+		m_capacity = capacity_;
+	}
+
+	/**
+	 * Get the lock guarding the list, e.g. to read its statistics.
+	 *
+	 * @return the lock.
+	 */
+	const Lock& lock () const
+	{
+		return m_lock;
+	}
+
+private:
+	/// Link in the list of elements.
+	struct Node
+	{
+		/// Stored element.
+		T item;
+		/// Next node towards the back, or `nullptr`.
+		Node* next;
+	};
+
+	/// Front of the list, or `nullptr` if empty.
+	Node* m_head = nullptr;
+	/// Back of the list, or `nullptr` if empty.
+	Node* m_tail = nullptr;
+	/// Number of elements stored.
+	std::size_t m_size = 0;
+	/// Maximum number of elements, or 0 if unbounded.
+	std::atomic<std::size_t> m_capacity{0};
+	/// Mutex used for locking push/pop/size calls.
+	Lock m_lock;
+
+	/**
+	 * Append an already-built chain of nodes.  Must be called with the lock held.
+	 *
+	 * @param first_ first node of the chain.
+	 * @param last_ last node of the chain, whose `next` must be `nullptr`.
+	 * @param num_ number of nodes in the chain.
+	 */
+	void link (Node* first_, Node* last_, std::size_t num_)
+	{
+		if (m_tail)
+			m_tail->next = first_;
+		else
+			m_head = first_;
+		m_tail = last_;
+		m_size += num_;
+	}
+
+	/**
+	 * Detach a chain of nodes from the front.  Must be called with the lock held.
+	 *
+	 * Detaching every node is constant time, otherwise linear in `num_`.
+	 *
+	 * @param num_ number of nodes to detach, no more than are stored.
+	 * @return first node of the detached chain, terminated by `nullptr`, or `nullptr` if `num_`
+	 * is 0.
+	 */
+	Node* unlink (std::size_t num_)
+	{
+		if (!num_)
+			return nullptr;
+
+		Node* first = m_head;
+		if (num_ == m_size)
+		{
+			m_head = m_tail = nullptr;
+		}
+		else
+		{
+			Node* last = first;
+			for (std::size_t i = 1; i < num_; i++)
+				last = last->next;
+			m_head = last->next;
+			last->next = nullptr;
+		}
+		m_size -= num_;
+		return first;
+	}
+
+	/**
+	 * Free a chain of nodes.
+	 *
+	 * @param node_ first node of the chain.
+	 */
+	static void free_nodes (Node* node_)
+	{
+		while (node_)
+		{
+			Node* next = node_->next;
+			delete node_;
+			node_ = next;
+		}
+	}
+};
+
+
+/**
+ * Bounded lock-free multi-producer/multi-consumer ring buffer storage backend.
+ *
+ * Each slot carries a sequence number, so producers and consumers only contend on a single CAS
+ * of the (cache-line padded) tail or head index, respectively, and never on each other.
+ *
+ * @tparam T type of element stored.
+ * @tparam N number of slots, must be a power of two.
+ */
+template <class T, std::size_t N>
+class RingStorage
+{
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "RingStorage size must be a power of two");
+
+public:
+	RingStorage () : m_cells(new Cell[N])
+	{
+		for (std::size_t i = 0; i < N; i++)
+			m_cells[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	RingStorage (const RingStorage&) = delete;
+	RingStorage& operator= (const RingStorage&) = delete;
+
+	/**
+	 * Destroy any elements remaining in the buffer.
+	 */
+	~RingStorage ()
+	{
+		while (try_pop());
+	}
+
+	/**
+	 * Thread-safely append an element, without locking.
+	 *
+	 * @param item_ element to append, moved from on success.
+	 * @return whether the element was appended, `false` if the buffer is full or at capacity.
+	 */
+	bool try_push (T&& item_)
+	{
+		bool was_empty;
+		return try_push(std::move(item_), was_empty);
+	}
+
+	/**
+	 * Thread-safely append an element, without locking, reporting whether it is at the front of
+	 * the buffer once written.
+	 *
+	 * A consumer reaching a slot that is claimed but not yet written finds the buffer empty, so
+	 * the element is only visible to waiting consumers once written: `was_empty_` is worked out
+	 * then, and is true if no consumer has moved past the element's slot.  Of several racing
+	 * producers, the one writing the front slot last therefore sees it, however earlier slots
+	 * were claimed.
+	 *
+	 * @param item_ element to append, moved from on success.
+	 * @param was_empty_ set to whether the element is at the front of the buffer once written,
+	 * so consumers may have found the buffer empty since it was claimed.
+	 * @return whether the element was appended, `false` if the buffer is full or at capacity.
+	 */
+	bool try_push (T&& item_, bool& was_empty_)
+	{
+		if (m_capacity < N && size() >= m_capacity)
+			return false;
+
+		Cell* cell;
+		std::size_t pos = m_tail.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell = &m_cells[pos & Mask];
+			const std::size_t seq = cell->seq.load(std::memory_order_acquire);
+			const std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+			if (diff == 0)
+			{
+				if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false;
+			else
+				pos = m_tail.load(std::memory_order_relaxed);
+		}
+		new (&cell->storage) T(std::move(item_));
+		cell->seq.store(pos + 1, std::memory_order_release);
+		// Pairs with the sequentially consistent head update and slot check in `try_pop`, so
+		// either a consumer sees the element written, or this sees that it hasn't moved past it.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		was_empty_ = m_head.load(std::memory_order_relaxed) == pos;
+		return true;
+	}
+
+	/**
+	 * Thread-safely append a range of elements, without locking.
+	 *
+	 * Appends as many elements as there are free slots, from the front of the range.  Elements
+	 * from other producers may be interleaved.
+	 *
+	 * @param first_ iterator to first element to append, elements are moved from.
+	 * @param last_ iterator past last element to append.
+	 * @param was_empty_ set to whether any element was at the front of the buffer once written
+	 * (see `try_push`).
+	 * @return number of elements appended.
+	 */
+	template <class It>
+	std::size_t try_push_bulk (It first_, It last_, bool& was_empty_)
+	{
+		was_empty_ = false;
+		std::size_t num = 0;
+		for (bool was_empty; first_ != last_; ++first_, ++num)
+		{
+			if (!try_push(std::move(*first_), was_empty))
+				break;
+			was_empty_ = was_empty_ || was_empty;
+		}
+		return num;
+	}
+
+	/**
+	 * Thread-safely remove up to `max_` elements from the front, without locking.
+	 *
+	 * @param out_ output iterator to move removed elements to.
+	 * @param max_ maximum number of elements to remove.
+	 * @return number of elements removed.
+	 */
+	template <class OutIt>
+	std::size_t try_pop_bulk (OutIt out_, std::size_t max_)
+	{
+		std::size_t num = 0;
+		for (; num < max_; num++)
+		{
+			boost::optional<T> item = try_pop();
+			if (!item)
+				break;
+			*out_++ = std::move(*item);
+		}
+		return num;
+	}
+
+	/**
+	 * Thread-safely remove the element at the front, without locking.
+	 *
+	 * @return the element, or `boost::none` if empty.
+	 */
+	boost::optional<T> try_pop ()
+	{
+		Cell* cell;
+		std::size_t pos = m_head.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell = &m_cells[pos & Mask];
+			const std::size_t seq = cell->seq.load(std::memory_order_seq_cst);
+			const std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)(pos + 1);
+			if (diff == 0)
+			{
+				if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_seq_cst,
+						std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return boost::none;
+			else
+				pos = m_head.load(std::memory_order_relaxed);
+		}
+		T* stored = reinterpret_cast<T*>(&cell->storage);
+		boost::optional<T> item(std::move(*stored));
+		stored->~T();
+		cell->seq.store(pos + N, std::memory_order_release);
+		return item;
+	}
+
+	/**
+	 * Thread-safely get approximate number of elements stored.
+	 *
+	 * Exact only when no push/pop is in flight.
+	 *
+	 * @return number of elements.
+	 */
+	std::size_t size ()
+	{
+		const std::size_t head = m_head.load(std::memory_order_acquire);
+		const std::size_t tail = m_tail.load(std::memory_order_acquire);
+		return tail > head ? tail - head : 0;
+	}
+
+	/**
+	 * Get maximum number of elements that can be stored.
+	 *
+	 * @return capacity.
+	 */
+	std::size_t capacity () const
+	{
+		return m_capacity;
+	}
+
+	/**
+	 * Set a soft limit on the number of elements that can be stored.
+	 *
+	 * The limit is approximate while pushes are in flight, but can never exceed the number of
+	 * slots.
+	 *
+	 * @param capacity_ new capacity, or 0 for the number of slots.
+	 */
+	void set_capacity (std::size_t capacity_)
+	{
+		m_capacity = (capacity_ && capacity_ < N) ? capacity_ : N;
+	}
+
+private:
+	/// Mask to convert a monotonic position to a slot index.
+	static const std::size_t Mask = N - 1;
+
+	/// Slot in the ring buffer.
+	struct Cell
+	{
+		/// Sequence number of the slot, used to hand it between producers and consumers.
+		std::atomic<std::size_t> seq;
+		/// Uninitialised storage for the element.
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+	};
+
+	/// Padding so the indices don't share a cache line with neighbouring members.
+	char m_pad0[CacheLine];
+	/// Position of next slot to push to.
+	std::atomic<std::size_t> m_tail{0};
+	/// Padding between producer and consumer indices.
+	char m_pad1[CacheLine - sizeof(std::atomic<std::size_t>)];
+	/// Position of next slot to pop from.
+	std::atomic<std::size_t> m_head{0};
+	/// Padding between consumer index and slots.
+	char m_pad2[CacheLine - sizeof(std::atomic<std::size_t>)];
+	/// Slots of the ring buffer.
+	std::unique_ptr<Cell[]> m_cells;
+	/// Soft limit on number of elements.
+	std::atomic<std::size_t> m_capacity{N};
+};
+
+} /* namespace LuaCppMsg */
+
+#endif /* INCLUDE_LUACPPMSG_STORAGE_HPP_ */
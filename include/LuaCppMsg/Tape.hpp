@@ -0,0 +1,529 @@
+#ifndef INCLUDE_LUACPPMSG_TAPE_HPP_
+#define INCLUDE_LUACPPMSG_TAPE_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/mpl/for_each.hpp>
+#include <boost/optional.hpp>
+#include <boost/variant.hpp>
+#include <LuaContext.hpp>
+#include <LuaCppMsg/FlatMap.hpp>
+
+namespace LuaCppMsg
+{
+
+/**
+ * A message serialised into a compact, contiguous byte encoding, so it can be converted to Lua
+ * tables in a single linear pass.
+ *
+ * Encoding happens on the producer's thread, taking the work of visiting the message's variants
+ * off the (single) Lua thread.  Only plain data can be encoded: numbers, booleans, strings, and
+ * Maps and Vecs of them.
+ *
+ * The encoding is a pre-order walk of the message.  Each value is an `Op` byte followed by its
+ * payload; a scalar's payload starts with the index of its variant alternative, so it can also be
+ * decoded back to the same C++ type.  Integers are stored as `int64_t`, numbers as `double`,
+ * strings and counts as a `uint32_t` length (or count) then the bytes (or entries), in native
+ * byte order.  A table's entries are a key (an integer or string) then a value.
+ */
+class Tape
+{
+public:
+	/// Encoding of each value.
+	enum class Op : char { False, True, Integer, Number, String, Table, Array };
+
+	/**
+	 * Construct an empty tape.
+	 */
+	Tape () = default;
+
+	/**
+	 * Encode a message.
+	 *
+	 * @param item_ message to encode.
+	 * @return whether the message only contains plain data, and so was encoded.  If not, the
+	 * tape is left empty.
+	 */
+	template <class TItem>
+	bool encode (const TItem& item_)
+	{
+		m_bytes.clear();
+		if (write(item_))
+			return true;
+		m_bytes.clear();
+		return false;
+	}
+
+	/**
+	 * Decode the message back into C++.
+	 *
+	 * @tparam TMsg message type, e.g. `Queue::Msg`, whose items were encoded.
+	 * @return the message item.
+	 * @throws std::out_of_range if the tape is empty.
+	 */
+	template <class TMsg>
+	typename TMsg::Item decode () const
+	{
+		if (m_bytes.empty())
+			throw std::out_of_range("Tape::decode: empty tape");
+		const char* pos = m_bytes.data();
+		return read_item<TMsg>(pos);
+	}
+
+	/**
+	 * Read a value of type `T` from an encoding, advancing past it.
+	 *
+	 * @param pos_ position in the encoding.
+	 * @return the value.
+	 */
+	template <class T>
+	static T get (const char*& pos_)
+	{
+		T value;
+		std::memcpy(&value, pos_, sizeof(T));
+		pos_ += sizeof(T);
+		return value;
+	}
+
+	/**
+	 * Get the encoded bytes.
+	 *
+	 * @return the encoding, empty if nothing has been encoded.
+	 */
+	const std::string& bytes () const
+	{
+		return m_bytes;
+	}
+
+private:
+	/// The encoding.
+	std::string m_bytes;
+
+	template <class T>
+	void put (const T& value_)
+	{
+		m_bytes.append(reinterpret_cast<const char*>(&value_), sizeof(T));
+	}
+
+	void put (Op op_)
+	{
+		m_bytes.push_back(static_cast<char>(op_));
+	}
+
+	void put_size (std::size_t size_)
+	{
+		put(static_cast<std::uint32_t>(size_));
+	}
+
+	/// Visitor writing the current alternative of a variant, as alternative `which`.
+	struct Writer : public boost::static_visitor<bool>
+	{
+		Writer(Tape& tape_, int which_) : tape(tape_), which(which_) {}
+
+		template <class T>
+		bool operator()(const T& value) const
+		{
+			return tape.write(value, which);
+		}
+
+		Tape& tape;
+		int which;
+	};
+
+	template <class... Ts>
+	bool write (const boost::variant<Ts...>& value_)
+	{
+		return boost::apply_visitor(Writer(*this, value_.which()), value_);
+	}
+
+	template <class T>
+	bool write (const T& value_)
+	{
+		return write(value_, 0);
+	}
+
+	template <class T>
+	bool write (const boost::recursive_wrapper<T>& value_, int which_)
+	{
+		return write(value_.get(), which_);
+	}
+
+	template <class T>
+	typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
+	write (const T& value_, int which_)
+	{
+		if (std::is_same<T, bool>::value)
+			put(value_ ? Op::True : Op::False);
+		else
+			put(std::is_integral<T>::value ? Op::Integer : Op::Number);
+		m_bytes.push_back(static_cast<char>(which_));
+		if (std::is_integral<T>::value && !std::is_same<T, bool>::value)
+			put(static_cast<std::int64_t>(value_));
+		else if (!std::is_same<T, bool>::value)
+			put(static_cast<double>(value_));
+		return true;
+	}
+
+	bool write (const std::string& value_, int which_)
+	{
+		put(Op::String);
+		m_bytes.push_back(static_cast<char>(which_));
+		write_string(value_);
+		return true;
+	}
+
+	template <class T, class A>
+	bool write (const std::vector<T, A>& value_, int)
+	{
+		put(Op::Array);
+		put_size(value_.size());
+		for (const T& elem : value_)
+			if (!write(elem))
+				return false;
+		return true;
+	}
+
+	template <class K, class V, class C>
+	bool write (const FlatMap<K, V, C>& value_, int)
+	{
+		return write_map(value_);
+	}
+
+	template <class K, class V, class H>
+	bool write (const std::unordered_map<K, V, H>& value_, int)
+	{
+		return write_map(value_);
+	}
+
+	/**
+	 * Anything else, e.g. a userdata-backed type, can't be encoded.
+	 */
+	template <class T>
+	typename std::enable_if<!std::is_arithmetic<T>::value, bool>::type
+	write (const T&, int)
+	{
+		return false;
+	}
+
+	template <class TMap>
+	bool write_map (const TMap& map_)
+	{
+		put(Op::Table);
+		// As when pushing a map, count integer keys that fit in the array part.
+		std::size_t narr = 0;
+		for (const auto& entry : map_)
+		{
+			const std::int64_t idx = key_index(entry.first);
+			narr += idx > 0 && std::size_t(idx) <= map_.size();
+		}
+		put_size(narr);
+		put_size(map_.size() - narr);
+		for (const auto& entry : map_)
+			if (!write_key(entry.first) || !write(entry.second))
+				return false;
+		return true;
+	}
+
+	/// Visitor getting a (key) variant's integer value, or 0 if it isn't integral.
+	struct KeyIndex : public boost::static_visitor<std::int64_t>
+	{
+		template <class T>
+		std::int64_t operator()(const T& key) const
+		{
+			return key_index(key);
+		}
+	};
+
+	template <class... Ts>
+	static std::int64_t key_index (const boost::variant<Ts...>& key_)
+	{
+		return boost::apply_visitor(KeyIndex(), key_);
+	}
+
+	template <class T>
+	static std::int64_t key_index (const T& key_)
+	{
+		return key_index(key_, std::is_integral<T>{});
+	}
+
+	template <class T>
+	static std::int64_t key_index (const T& key_, std::true_type)
+	{
+		return static_cast<std::int64_t>(key_);
+	}
+
+	template <class T>
+	static std::int64_t key_index (const T&, std::false_type)
+	{
+		return 0;
+	}
+
+	/// Visitor writing the current alternative of a (key) variant.
+	struct KeyWriter : public boost::static_visitor<bool>
+	{
+		explicit KeyWriter(Tape& tape_) : tape(tape_) {}
+
+		template <class T>
+		bool operator()(const T& key) const
+		{
+			return tape.write_key(key);
+		}
+
+		Tape& tape;
+	};
+
+	template <class... Ts>
+	bool write_key (const boost::variant<Ts...>& key_)
+	{
+		return boost::apply_visitor(KeyWriter(*this), key_);
+	}
+
+	template <class T>
+	typename std::enable_if<std::is_integral<T>::value, bool>::type
+	write_key (const T& key_)
+	{
+		put(Op::Integer);
+		put(static_cast<std::int64_t>(key_));
+		return true;
+	}
+
+	bool write_key (const std::string& key_)
+	{
+		put(Op::String);
+		write_string(key_);
+		return true;
+	}
+
+	template <class T>
+	typename std::enable_if<!std::is_integral<T>::value, bool>::type
+	write_key (const T&)
+	{
+		return false;
+	}
+
+	void write_string (const std::string& value_)
+	{
+		put_size(value_.size());
+		m_bytes.append(value_);
+	}
+
+	/// Visitor over the alternatives of a variant, constructing the `which`th from a scalar.
+	template <class TItem, class TValue>
+	struct AlternativeMaker
+	{
+		template <class T>
+		void operator()(T*)
+		{
+			if (idx++ == which)
+				make(static_cast<T*>(nullptr), std::is_arithmetic<T>{});
+		}
+
+		template <class T>
+		void make(T*, std::true_type)
+		{
+			out.emplace(static_cast<T>(value));
+		}
+
+		template <class T>
+		void make(T*, std::false_type) {}
+
+		int which;
+		int idx;
+		TValue value;
+		boost::optional<TItem>& out;
+	};
+
+	/**
+	 * Construct the `which_`th alternative of a variant from a scalar, directly, so the variant
+	 * needn't be default constructible.
+	 *
+	 * @throws std::out_of_range if that alternative isn't arithmetic.
+	 */
+	template <class TItem, class TValue>
+	static TItem make_scalar (int which_, TValue value_)
+	{
+		boost::optional<TItem> out;
+		boost::mpl::for_each<typename TItem::types, boost::add_pointer<boost::mpl::_1>>(
+			AlternativeMaker<TItem, TValue>{ which_, 0, value_, out }
+		);
+		if (!out)
+			throw std::out_of_range("Tape::decode: scalar alternative out of range");
+		return std::move(*out);
+	}
+
+	template <class TMsg>
+	static typename TMsg::Item read_item (const char*& pos_)
+	{
+		using Item = typename TMsg::Item;
+		const Op op = static_cast<Op>(*pos_++);
+		if (op == Op::Table)
+		{
+			const std::uint32_t narr = get<std::uint32_t>(pos_);
+			const std::uint32_t nrec = get<std::uint32_t>(pos_);
+			typename TMsg::Map map;
+			map.reserve(narr + nrec);
+			for (std::uint32_t i = 0; i < narr + nrec; i++)
+			{
+				typename TMsg::Key key = read_key<TMsg>(pos_);
+				map.emplace(std::move(key), read_item<TMsg>(pos_));
+			}
+			return Item(std::move(map));
+		}
+		if (op == Op::Array)
+		{
+			const std::uint32_t size = get<std::uint32_t>(pos_);
+			typename TMsg::Vec vec;
+			vec.reserve(size);
+			for (std::uint32_t i = 0; i < size; i++)
+				vec.push_back(read_item<TMsg>(pos_));
+			return Item(std::move(vec));
+		}
+
+		const int which = static_cast<unsigned char>(*pos_++);
+		switch (op)
+		{
+		case Op::False:
+			return make_scalar<Item>(which, false);
+		case Op::True:
+			return make_scalar<Item>(which, true);
+		case Op::Integer:
+			return make_scalar<Item>(which, get<std::int64_t>(pos_));
+		case Op::Number:
+			return make_scalar<Item>(which, get<double>(pos_));
+		default:
+		{
+			const std::uint32_t size = get<std::uint32_t>(pos_);
+			pos_ += size;
+			return Item(typename TMsg::Str(pos_ - size, size));
+		}
+		}
+	}
+
+	template <class TMsg>
+	static typename TMsg::Key read_key (const char*& pos_)
+	{
+		const Op op = static_cast<Op>(*pos_++);
+		if (op == Op::Integer)
+			return typename TMsg::Key(static_cast<typename TMsg::Int>(get<std::int64_t>(pos_)));
+		const std::uint32_t size = get<std::uint32_t>(pos_);
+		pos_ += size;
+		return typename TMsg::Key(typename TMsg::Str(pos_ - size, size));
+	}
+};
+
+} /* namespace LuaCppMsg */
+
+
+/**
+ * Push a `Tape` to Lua, decoding it into tables in a single pass.
+ *
+ * Tables are presized and filled with raw sets, as when pushing a message directly.  An empty
+ * tape is pushed as `nil`.
+ */
+template <>
+struct LuaContext::Pusher<LuaCppMsg::Tape>
+{
+	static const int minSize = 1;
+	static const int maxSize = 1;
+
+	static PushedObject push(lua_State* state, const LuaCppMsg::Tape& value) noexcept
+	{
+		if (value.bytes().empty())
+		{
+			lua_pushnil(state);
+			return PushedObject{state, 1};
+		}
+		const char* pos = value.bytes().data();
+		push_value(state, pos);
+		return PushedObject{state, 1};
+	}
+
+private:
+	using Op = LuaCppMsg::Tape::Op;
+
+	template <class T>
+	static T get(const char*& pos)
+	{
+		return LuaCppMsg::Tape::get<T>(pos);
+	}
+
+	static void push_value(lua_State* state, const char*& pos)
+	{
+		const Op op = static_cast<Op>(*pos++);
+		switch (op)
+		{
+		case Op::Table:
+		{
+			const std::uint32_t narr = get<std::uint32_t>(pos);
+			const std::uint32_t nrec = get<std::uint32_t>(pos);
+			lua_createtable(state, static_cast<int>(narr), static_cast<int>(nrec));
+			for (std::uint32_t i = 0; i < narr + nrec; i++)
+			{
+				if (static_cast<Op>(*pos++) == Op::Integer)
+				{
+					const std::int64_t key = get<std::int64_t>(pos);
+					if (key > 0 && key <= narr + nrec)
+					{
+						push_value(state, pos);
+						lua_rawseti(state, -2, static_cast<int>(key));
+						continue;
+					}
+					lua_pushnumber(state, static_cast<lua_Number>(key));
+				}
+				else
+				{
+					const std::uint32_t size = get<std::uint32_t>(pos);
+					lua_pushlstring(state, pos, size);
+					pos += size;
+				}
+				push_value(state, pos);
+				lua_rawset(state, -3);
+			}
+			return;
+		}
+		case Op::Array:
+		{
+			const std::uint32_t size = get<std::uint32_t>(pos);
+			lua_createtable(state, static_cast<int>(size), 0);
+			for (std::uint32_t i = 1; i <= size; i++)
+			{
+				push_value(state, pos);
+				lua_rawseti(state, -2, static_cast<int>(i));
+			}
+			return;
+		}
+		default:
+			break;
+		}
+
+		pos++;  // Variant alternative, only needed in C++.
+		switch (op)
+		{
+		case Op::False:
+		case Op::True:
+			lua_pushboolean(state, op == Op::True);
+			return;
+		case Op::Integer:
+			Pusher<std::int64_t>::push(state, get<std::int64_t>(pos)).release();
+			return;
+		case Op::Number:
+			lua_pushnumber(state, get<double>(pos));
+			return;
+		default:
+		{
+			const std::uint32_t size = get<std::uint32_t>(pos);
+			lua_pushlstring(state, pos, size);
+			pos += size;
+			return;
+		}
+		}
+	}
+};
+
+#endif /* INCLUDE_LUACPPMSG_TAPE_HPP_ */
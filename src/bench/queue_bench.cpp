@@ -0,0 +1,1000 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/smart_ptr/detail/spinlock.hpp>
+#include <LuaCppMsg.hpp>
+
+using namespace LuaCppMsg;
+
+/// A fixed-shape message, for comparing a schema'd struct with a `Map`.
+struct Pose
+{
+	int id = 0;
+	double x = 0;
+	double y = 0;
+	double z = 0;
+	std::string frame;
+};
+LUACPPMSG_SCHEMA(Pose, id, x, y, z, frame)
+
+namespace
+{
+
+/**
+ * Benchmark results, printed as text tables as they are measured, or as a single JSON document
+ * once all are, for tracking regressions between releases.
+ */
+class Report
+{
+public:
+	/**
+	 * Parse the command line: `--json` selects JSON output, and any other arguments select the
+	 * tables whose names contain one of them (all tables if there are none).
+	 */
+	Report (int argc_, char* argv_[])
+	{
+		for (int i = 1; i < argc_; i++)
+		{
+			if (std::string(argv_[i]) == "--json")
+				m_json = true;
+			else
+				m_filters.push_back(argv_[i]);
+		}
+	}
+
+	/**
+	 * Start a table of results.
+	 *
+	 * @param name_ name of the table, identifying it in JSON.
+	 * @param key_ heading of the row labels.
+	 * @param columns_ headings of the results in each row.
+	 * @return whether the table is selected, and so should be measured.
+	 */
+	bool table (const std::string& name_, const std::string& key_,
+		std::vector<std::string> columns_)
+	{
+		bool selected = m_filters.empty();
+		for (const std::string& filter : m_filters)
+			selected |= name_.find(filter) != std::string::npos;
+		if (!selected)
+			return false;
+
+		m_tables.push_back(Table{ name_, key_, std::move(columns_), {} });
+		if (!m_json)
+		{
+			std::printf("%s%-10s", m_tables.size() > 1 ? "\n" : "", key_.c_str());
+			for (const std::string& column : m_tables.back().columns)
+				std::printf(" %16s", column.c_str());
+			std::printf("\n");
+		}
+		return true;
+	}
+
+	/**
+	 * Add a row of results to the current table.
+	 *
+	 * @param label_ label of the row.
+	 * @param values_ results, one per column.
+	 */
+	void row (const std::string& label_, std::vector<double> values_)
+	{
+		if (!m_json)
+		{
+			std::printf("%-10s", label_.c_str());
+			for (double value : values_)
+				std::printf(" %16.0f", value);
+			std::printf("\n");
+		}
+		m_tables.back().rows.emplace_back(label_, std::move(values_));
+	}
+
+	/**
+	 * Print the JSON document, if selected.
+	 */
+	void finish () const
+	{
+		if (!m_json)
+			return;
+		std::printf("{\n  \"compiler\": \"%s\",\n", escaped(__VERSION__).c_str());
+		std::printf("  \"hardware_concurrency\": %u,\n", std::thread::hardware_concurrency());
+		std::printf("  \"benchmarks\": [");
+		for (std::size_t t = 0; t < m_tables.size(); t++)
+		{
+			const Table& table = m_tables[t];
+			std::printf("%s\n    {\n      \"name\": \"%s\",\n      \"rows\": [",
+				t ? "," : "", escaped(table.name).c_str());
+			for (std::size_t r = 0; r < table.rows.size(); r++)
+			{
+				std::printf("%s\n        {\"%s\": \"%s\"", r ? "," : "",
+					escaped(table.key).c_str(), escaped(table.rows[r].first).c_str());
+				for (std::size_t c = 0; c < table.columns.size(); c++)
+					std::printf(", \"%s\": %.6g",
+						escaped(table.columns[c]).c_str(), table.rows[r].second[c]);
+				std::printf("}");
+			}
+			std::printf("\n      ]\n    }");
+		}
+		std::printf("\n  ]\n}\n");
+	}
+
+private:
+	struct Table
+	{
+		std::string name;
+		std::string key;
+		std::vector<std::string> columns;
+		std::vector<std::pair<std::string, std::vector<double>>> rows;
+	};
+
+	static std::string escaped (const std::string& str_)
+	{
+		std::string out;
+		for (char c : str_)
+		{
+			if (c == '"' || c == '\\')
+				out += '\\';
+			out += c;
+		}
+		return out;
+	}
+
+	/// Whether to print JSON rather than text.
+	bool m_json = false;
+	/// Substrings of the names of the tables to measure, or empty to measure all.
+	std::vector<std::string> m_filters;
+	/// Tables measured so far.
+	std::vector<Table> m_tables;
+};
+
+/// Number of messages each producer pushes.
+const unsigned NumPerProducer = 200000;
+
+/**
+ * Time `num_producers_` C++ threads pushing small maps to a single C++ consumer.
+ *
+ * @return messages per second.
+ */
+template <class QueueType>
+double producers_to_consumer (unsigned num_producers_)
+{
+	QueueType queue;
+	const unsigned total = num_producers_ * NumPerProducer;
+	std::atomic<bool> go{false};
+
+	auto producer = [&queue, &go]() {
+		while (!go)
+			std::this_thread::yield();
+		for (unsigned i = 0; i < NumPerProducer; i++)
+			queue.push(typename QueueType::Map{{"value", double(i)}});
+	};
+
+	std::vector<std::thread> producers;
+	for (unsigned i = 0; i < num_producers_; i++)
+		producers.emplace_back(producer);
+
+	const auto start = std::chrono::steady_clock::now();
+	go = true;
+
+	unsigned num_popped = 0;
+	while (num_popped < total)
+		if (queue.pop())
+			num_popped++;
+
+	const auto end = std::chrono::steady_clock::now();
+	for (std::thread& t : producers)
+		t.join();
+
+	const double secs = std::chrono::duration<double>(end - start).count();
+	return total / secs;
+}
+
+/**
+ * Time 4 C++ producers pushing small maps in batches of `batch_size_` to a single C++ consumer
+ * popping in batches of the same size.
+ *
+ * A batch size of 1 uses the single-message `push`/`pop`.
+ *
+ * @return messages per second.
+ */
+template <class QueueType>
+double batched_producers_to_consumer (unsigned batch_size_)
+{
+	const unsigned num_producers = 4;
+	QueueType queue;
+	const unsigned total = num_producers * NumPerProducer;
+	std::atomic<bool> go{false};
+
+	auto producer = [&queue, &go, batch_size_]() {
+		while (!go)
+			std::this_thread::yield();
+		for (unsigned i = 0; i < NumPerProducer; i += batch_size_)
+		{
+			if (batch_size_ == 1)
+			{
+				queue.push(typename QueueType::Map{{"value", double(i)}});
+				continue;
+			}
+			std::vector<typename QueueType::Item> batch;
+			batch.reserve(batch_size_);
+			for (unsigned j = 0; j < batch_size_; j++)
+				batch.push_back(typename QueueType::Map{{"value", double(i + j)}});
+			queue.push_bulk(std::move(batch));
+		}
+	};
+
+	std::vector<std::thread> producers;
+	for (unsigned i = 0; i < num_producers; i++)
+		producers.emplace_back(producer);
+
+	const auto start = std::chrono::steady_clock::now();
+	go = true;
+
+	unsigned num_popped = 0;
+	while (num_popped < total)
+		if (batch_size_ == 1)
+			num_popped += bool(queue.pop());
+		else
+			num_popped += queue.pop_bulk(batch_size_).size();
+
+	const auto end = std::chrono::steady_clock::now();
+	for (std::thread& t : producers)
+		t.join();
+
+	const double secs = std::chrono::duration<double>(end - start).count();
+	return total / secs;
+}
+
+/// Number of large messages each producer pushes.
+const unsigned NumLargePerProducer = 5000;
+
+/**
+ * Reference queue deep-copying each message while holding its lock, as `Queue` once did.
+ *
+ * Used as a baseline for the cost of contention on the copy.
+ */
+template <class QueueType>
+class CopyUnderLockQueue
+{
+public:
+	using Item = typename QueueType::Item;
+	using Map = typename QueueType::Map;
+
+	void push (const Item& msg_)
+	{
+		std::lock_guard<boost::detail::spinlock> lock(m_lock);
+		m_queue.push(msg_);
+	}
+
+	bool pop ()
+	{
+		std::lock_guard<boost::detail::spinlock> lock(m_lock);
+		if (m_queue.empty())
+			return false;
+		m_queue.pop();
+		return true;
+	}
+
+private:
+	std::queue<Item> m_queue;
+	boost::detail::spinlock m_lock = BOOST_DETAIL_SPINLOCK_INIT;
+};
+
+/**
+ * Build a map of 8 submaps, each of 16 numbers and strings.
+ */
+template <class QueueType>
+typename QueueType::Item large_nested_map ()
+{
+	using Map = typename QueueType::Map;
+	Map map;
+	for (int i = 0; i < 8; i++)
+	{
+		Map sub;
+		for (int j = 0; j < 16; j++)
+			sub[j] = j % 2 ? typename QueueType::Item(double(j)) : std::string("value");
+		map["sub" + std::to_string(i)] = std::move(sub);
+	}
+	return map;
+}
+
+/**
+ * Time `num_producers_` C++ threads pushing copies of a large nested map to a single C++
+ * consumer.
+ *
+ * @return messages per second.
+ */
+template <class QueueType, class MapQueueType>
+double large_producers_to_consumer (unsigned num_producers_)
+{
+	QueueType queue;
+	const unsigned total = num_producers_ * NumLargePerProducer;
+	const typename MapQueueType::Item msg = large_nested_map<MapQueueType>();
+	std::atomic<bool> go{false};
+
+	auto producer = [&queue, &go, &msg]() {
+		while (!go)
+			std::this_thread::yield();
+		for (unsigned i = 0; i < NumLargePerProducer; i++)
+			queue.push(msg);
+	};
+
+	std::vector<std::thread> producers;
+	for (unsigned i = 0; i < num_producers_; i++)
+		producers.emplace_back(producer);
+
+	const auto start = std::chrono::steady_clock::now();
+	go = true;
+
+	unsigned num_popped = 0;
+	while (num_popped < total)
+		if (queue.pop())
+			num_popped++;
+
+	const auto end = std::chrono::steady_clock::now();
+	for (std::thread& t : producers)
+		t.join();
+
+	const double secs = std::chrono::duration<double>(end - start).count();
+	return total / secs;
+}
+
+/// Number of conversions of each deep Lua table.
+const unsigned NumConversions = 200;
+
+/// Custom types ahead of the string and map alternatives, as a typical queue would have.
+struct Vec3 { double x, y, z; };
+struct Quat { double w, x, y, z; };
+using CustomQueue = Queue<double, Vec3, Quat>;
+
+/**
+ * Time converting a Lua table nested `depth_` deep, with 4 subtables and some leaves per level,
+ * to a C++ `Item`.
+ *
+ * @tparam ReadType type read from Lua, either `Item` for "luawrapper"'s trial-and-error variant
+ * reader, or `Owned<Item>` for the queue's type-switch reader.
+ * @return conversions per second.
+ */
+template <class ReadType>
+double lua_to_cpp (unsigned depth_)
+{
+	lua_State* L = luaL_newstate();
+	double secs;
+	{
+		LuaContext lua(L);
+		lua.writeVariable("depth", depth_);
+		lua.executeCode(
+			"local function build (level)"
+			"  local t = {name='node', value=1.5, [1]=1, [2]=2}"
+			"  if level > 1 then"
+			"    for i = 1, 4 do t['child' .. i] = build(level - 1) end"
+			"  end "
+			"  return t "
+			"end "
+			"deep = build(depth)"
+		);
+
+		const auto start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < NumConversions; i++)
+			if (!lua.readVariable<boost::optional<ReadType>>("deep"))
+				std::printf("conversion failed\n");
+		const auto end = std::chrono::steady_clock::now();
+
+		secs = std::chrono::duration<double>(end - start).count();
+	}
+	lua_close(L);
+	return NumConversions / secs;
+}
+
+/**
+ * Time converting a C++ map of `num_fields_` entries, half array-like and half named, to a Lua
+ * table.
+ *
+ * Each conversion is of a fresh copy, as each popped message would be.
+ *
+ * @tparam Wrap wrap the copy before pushing, either leaving it an `Item` for "luawrapper"'s
+ * pusher, or making it an `Owned<Item>` for the queue's presized, consuming pusher.
+ * @return conversions per second.
+ */
+template <template <class> class Wrap>
+double cpp_to_lua (unsigned num_fields_)
+{
+	using Item = CustomQueue::Item;
+	CustomQueue::Map map;
+	for (unsigned i = 1; i <= num_fields_ / 2; i++)
+	{
+		map[int(i)] = double(i);
+		map["field" + std::to_string(i)] = double(i);
+	}
+	const Item item(map);
+
+	lua_State* L = luaL_newstate();
+	double secs;
+	{
+		LuaContext lua(L);
+		const auto start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < NumConversions * 10; i++)
+			lua.writeVariable("wide", Wrap<Item>{ Item(item) });
+		const auto end = std::chrono::steady_clock::now();
+		secs = std::chrono::duration<double>(end - start).count();
+	}
+	lua_close(L);
+	return NumConversions * 10 / secs;
+}
+
+/// Leave an `Item` as-is, to be pushed by "luawrapper".
+template <class T>
+using Unwrapped = T;
+
+/**
+ * Time handing a frame of `num_elements_` doubles from C++ to Lua, as a copy of the message would
+ * be handed between queue stages and then popped.
+ *
+ * @param dense_ whether to send the frame as a `Dense` array rather than a `Vec` of `Item`s.
+ * @return frames per second.
+ */
+double frame_to_lua (unsigned num_elements_, bool dense_)
+{
+	using Item = CustomQueue::Item;
+	std::vector<double> values(num_elements_, 1.5);
+	const Item frame = dense_
+		? Item(CustomQueue::Dense(std::move(values)))
+		: Item(CustomQueue::Vec(values.begin(), values.end()));
+
+	lua_State* L = luaL_newstate();
+	double secs;
+	{
+		LuaContext lua(L);
+		const auto start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < NumConversions; i++)
+			lua.writeVariable("frame", Owned<Item>{ Item(frame) });
+		const auto end = std::chrono::steady_clock::now();
+		secs = std::chrono::duration<double>(end - start).count();
+	}
+	lua_close(L);
+	return NumConversions / secs;
+}
+
+/// Number of copies and lookups of each small message.
+const unsigned NumSmallMessages = 200000;
+
+/**
+ * Time copying a message of `num_keys_` string keys, as each push does, then looking up every
+ * key with `Message::get`.
+ *
+ * @return messages per second.
+ */
+template <class QueueType>
+double small_message_copy_get (unsigned num_keys_)
+{
+	using Item = typename QueueType::Item;
+	std::vector<std::string> keys;
+	typename QueueType::Map map;
+	for (unsigned i = 0; i < num_keys_; i++)
+	{
+		keys.push_back("key" + std::to_string(i));
+		map[keys.back()] = double(i);
+	}
+	const Item item(map);
+
+	double sum = 0;
+	const auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < NumSmallMessages; i++)
+	{
+		const typename QueueType::Msg msg(Item{ item });
+		for (const std::string& key : keys)
+			sum += msg.get(key).template as<double>();
+	}
+	const auto end = std::chrono::steady_clock::now();
+
+	if (sum < 0)
+		std::printf("unexpected sum\n");
+	const double secs = std::chrono::duration<double>(end - start).count();
+	return NumSmallMessages / secs;
+}
+
+/**
+ * Time looking up every field of a message by name, either by building a `Key` from each name, as
+ * `Message::get(const char*)` used to, or directly.
+ *
+ * @param key_length_ length of each field name.
+ * @param by_key_ whether to build a `Key` for each lookup.
+ * @return field accesses per second.
+ */
+double field_access (unsigned key_length_, bool by_key_)
+{
+	using SimpleQueue = Queue<double>;
+	std::vector<std::string> names;
+	SimpleQueue::Map map;
+	for (unsigned i = 0; i < 8; i++)
+	{
+		names.push_back(std::string(key_length_ - 1, 'k') + char('a' + i));
+		map[names.back()] = double(i);
+	}
+	const SimpleQueue::Msg msg{ SimpleQueue::Item(map) };
+
+	double sum = 0;
+	const auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < NumSmallMessages; i++)
+		for (const std::string& name : names)
+		{
+			const char* cname = name.c_str();
+			sum += by_key_
+				? msg.get(SimpleQueue::Key(SimpleQueue::Str(cname))).as<double>()
+				: msg.get(cname).as<double>();
+		}
+	const auto end = std::chrono::steady_clock::now();
+
+	if (sum < 0)
+		std::printf("unexpected sum\n");
+	const double secs = std::chrono::duration<double>(end - start).count();
+	return NumSmallMessages * names.size() / secs;
+}
+
+/**
+ * Time passing fixed-shape messages from C++ through Lua and back, then reading their fields.
+ *
+ * @param schema_ whether to send each message as a schema'd struct rather than a `Map`.
+ * @return round trips per second.
+ */
+double fixed_shape_round_trip (bool schema_)
+{
+	using PoseQueue = Queue<double, Pose>;
+	const unsigned num = NumSmallMessages / 4;
+	lua_State* L = luaL_newstate();
+	double secs;
+	{
+		PoseQueue queue(L, "lqueue");
+		queue.lua()->writeVariable("num", num);
+
+		const auto start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < num; i++)
+		{
+			if (schema_)
+				queue.push(Pose{ int(i), 1.5, 2.5, 3.5, "map" });
+			else
+				queue.push(PoseQueue::Map{
+					{ "id", double(i) }, { "x", 1.5 }, { "y", 2.5 }, { "z", 3.5 },
+					{ "frame", PoseQueue::Str("map") }
+				});
+		}
+		queue.lua()->executeCode("for i = 1, num do lqueue:push(lqueue:pop()) end");
+		double sum = 0;
+		while (PoseQueue::Opt msg = queue.pop())
+		{
+			if (schema_)
+			{
+				const Pose& pose = boost::get<Pose>(msg->item());
+				sum += pose.x + pose.y + pose.z + pose.frame.size();
+			}
+			else
+			{
+				sum += msg->get("x").as<double>() + msg->get("y").as<double>()
+					+ msg->get("z").as<double>() + msg->get("frame").as<PoseQueue::Str>().size();
+			}
+		}
+		const auto end = std::chrono::steady_clock::now();
+
+		if (sum < 0)
+			std::printf("unexpected sum\n");
+		secs = std::chrono::duration<double>(end - start).count();
+	}
+	lua_close(L);
+	return num / secs;
+}
+
+/**
+ * Time a Lua routing loop that pops messages and reads only their `type`, with a payload of
+ * `num_fields_` numbers that is never read.
+ *
+ * @param lazy_ whether to pop with `pop_lazy` rather than `pop`.
+ * @return messages per second.
+ */
+double route_by_type (unsigned num_fields_, bool lazy_)
+{
+	using SimpleQueue = Queue<double>;
+	const unsigned num = NumSmallMessages / 20;
+	SimpleQueue::Map payload;
+	for (unsigned i = 0; i < num_fields_; i++)
+		payload["field" + std::to_string(i)] = double(i);
+	const SimpleQueue::Item msg(SimpleQueue::Map{
+		{ "type", SimpleQueue::Str("pose") }, { "payload", payload }
+	});
+
+	lua_State* L = luaL_newstate();
+	double secs;
+	{
+		SimpleQueue queue(L, "lqueue");
+		for (unsigned i = 0; i < num; i++)
+			queue.push(msg);
+		queue.lua()->writeVariable("num", num);
+		queue.lua()->writeVariable("pop", lazy_ ? "pop_lazy" : "pop");
+
+		const auto start = std::chrono::steady_clock::now();
+		queue.lua()->executeCode(
+			"local n = 0 "
+			"for i = 1, num do"
+			"  if lqueue[pop](lqueue).type == 'pose' then n = n + 1 end "
+			"end"
+		);
+		const auto end = std::chrono::steady_clock::now();
+		secs = std::chrono::duration<double>(end - start).count();
+	}
+	lua_close(L);
+	return num / secs;
+}
+
+
+/**
+ * Push messages of `num_fields_` numbers and strings from C++, then pop them all in Lua, reading
+ * one field of each.
+ *
+ * @tparam QueueType queue type, serialising pushes or not.
+ * @return messages per second pushed on the producer's thread, and popped on the Lua thread.
+ */
+template <class QueueType>
+std::pair<double, double> push_then_pop (unsigned num_fields_)
+{
+	const unsigned num = NumSmallMessages / 20;
+	typename QueueType::Map payload;
+	for (unsigned i = 0; i < num_fields_; i++)
+	{
+		payload["field" + std::to_string(i)] = double(i);
+		payload[int(i + 1)] = typename QueueType::Str("value" + std::to_string(i));
+	}
+	const typename QueueType::Item msg(typename QueueType::Map{
+		{ "type", typename QueueType::Str("pose") }, { "payload", payload }
+	});
+
+	lua_State* L = luaL_newstate();
+	double push_secs;
+	double pop_secs;
+	{
+		QueueType queue(L, "lqueue");
+		queue.lua()->writeVariable("num", num);
+
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < num; i++)
+			queue.push(msg);
+		auto end = std::chrono::steady_clock::now();
+		push_secs = std::chrono::duration<double>(end - start).count();
+
+		start = std::chrono::steady_clock::now();
+		queue.lua()->executeCode(
+			"local n = 0 "
+			"for i = 1, num do"
+			"  if lqueue:pop().type == 'pose' then n = n + 1 end "
+			"end"
+		);
+		end = std::chrono::steady_clock::now();
+		pop_secs = std::chrono::duration<double>(end - start).count();
+	}
+	lua_close(L);
+	return std::make_pair(num / push_secs, num / pop_secs);
+}
+
+
+/// Message shapes compared for conversion cost.
+const std::vector<std::string> Shapes{ "flat", "nested", "wide", "array" };
+
+/**
+ * Build a message of a given shape.
+ *
+ * @param shape_ "flat", 8 numbers and strings; "nested", 3 levels of 4 submaps; "wide", 256 named
+ * numbers; or "array", a Vec of 256 numbers.
+ */
+Queue<double>::Item shape_message (const std::string& shape_)
+{
+	using SimpleQueue = Queue<double>;
+	SimpleQueue::Map map;
+	if (shape_ == "flat")
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			map["num" + std::to_string(i)] = double(i);
+			map["str" + std::to_string(i)] = SimpleQueue::Str("value");
+		}
+	}
+	else if (shape_ == "nested")
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			SimpleQueue::Map sub;
+			for (int j = 0; j < 4; j++)
+				sub["leaf" + std::to_string(j)] = SimpleQueue::Map{
+					{ "x", double(j) }, { "name", SimpleQueue::Str("leaf") }
+				};
+			map["sub" + std::to_string(i)] = std::move(sub);
+		}
+	}
+	else if (shape_ == "wide")
+	{
+		for (int i = 0; i < 256; i++)
+			map["field" + std::to_string(i)] = double(i);
+	}
+	else
+	{
+		return SimpleQueue::Vec(256, 1.5);
+	}
+	return map;
+}
+
+/// Number of messages of each shape converted.
+const unsigned NumShapeMessages = 5000;
+
+/**
+ * Time converting messages of a given shape between C++ and Lua through a queue.
+ *
+ * @param shape_ message shape, see `shape_message`.
+ * @param direction_ "to lua", popping messages pushed from C++; "from lua", pushing them from
+ * Lua; or "lua push+pop", pushing and popping each one in Lua.
+ * @return conversions (or pairs of them) per second.
+ */
+double shape_conversion (const std::string& shape_, const std::string& direction_)
+{
+	using SimpleQueue = Queue<double>;
+	const SimpleQueue::Item msg = shape_message(shape_);
+	lua_State* L = luaL_newstate();
+	double secs;
+	{
+		SimpleQueue queue(L, "lqueue");
+		SimpleQueue::Lua lua = queue.lua();
+		lua->writeVariable("num", NumShapeMessages);
+		queue.push(msg);
+		lua->executeCode("msg = lqueue:pop()");
+
+		if (direction_ == "to lua")
+			for (unsigned i = 0; i < NumShapeMessages; i++)
+				queue.push(msg);
+
+		const auto start = std::chrono::steady_clock::now();
+		if (direction_ == "to lua")
+			lua->executeCode("for i = 1, num do lqueue:pop() end");
+		else if (direction_ == "from lua")
+			lua->executeCode("for i = 1, num do lqueue:push(msg) end");
+		else
+			lua->executeCode("for i = 1, num do lqueue:push(msg) lqueue:pop() end");
+		const auto end = std::chrono::steady_clock::now();
+		secs = std::chrono::duration<double>(end - start).count();
+	}
+	lua_close(L);
+	return NumShapeMessages / secs;
+}
+
+/// Number of messages whose latency is measured.
+const unsigned NumLatencyMessages = 20000;
+
+/**
+ * Nanoseconds on the steady clock, as a message field.
+ */
+double now_ns ()
+{
+	return std::chrono::duration<double, std::nano>(
+		std::chrono::steady_clock::now().time_since_epoch()
+	).count();
+}
+
+/**
+ * Measure the latency from a C++ producer pushing a message, one every 20us, to a consumer
+ * receiving it.
+ *
+ * @param lua_ whether the consumer is a Lua script polling `pop`, rather than a C++ thread
+ * waiting in `pop_wait`.
+ * @return latencies in nanoseconds, sorted.
+ */
+std::vector<double> push_to_pop_latencies (bool lua_)
+{
+	using SimpleQueue = Queue<double>;
+	std::vector<double> latencies;
+	latencies.reserve(NumLatencyMessages);
+	lua_State* L = luaL_newstate();
+	{
+		SimpleQueue queue(L, "lqueue");
+		SimpleQueue::Lua lua = queue.lua();
+		lua->writeVariable("num", NumLatencyMessages);
+		lua->writeVariable("received", std::function<void (double)>(
+			[&latencies](double sent_) { latencies.push_back(now_ns() - sent_); }
+		));
+
+		std::thread producer([&queue]() {
+			auto next = std::chrono::steady_clock::now();
+			for (unsigned i = 0; i < NumLatencyMessages; i++)
+			{
+				next += std::chrono::microseconds(20);
+				while (std::chrono::steady_clock::now() < next)
+					std::this_thread::yield();
+				queue.push(SimpleQueue::Map{{ "sent", now_ns() }, { "value", double(i) }});
+			}
+		});
+
+		if (lua_)
+			lua->executeCode(
+				"local n = 0 "
+				"while n < num do"
+				"  local msg = lqueue:pop() "
+				"  if msg then received(msg.sent) n = n + 1 end "
+				"end"
+			);
+		else
+			for (unsigned i = 0; i < NumLatencyMessages; i++)
+			{
+				const double sent = queue.pop_wait().get("sent").as<double>();
+				latencies.push_back(now_ns() - sent);
+			}
+		producer.join();
+	}
+	lua_close(L);
+	std::sort(latencies.begin(), latencies.end());
+	return latencies;
+}
+
+/**
+ * Get a percentile of sorted values.
+ *
+ * @param sorted_ values, in ascending order.
+ * @param percent_ percentile, from 0 to 100.
+ */
+double percentile (const std::vector<double>& sorted_, double percent_)
+{
+	const std::size_t idx = std::size_t(percent_ / 100 * (sorted_.size() - 1) + 0.5);
+	return sorted_[idx];
+}
+
+} /* namespace */
+
+
+int main (int argc, char* argv[])
+{
+	using SpinlockQueue = Queue<double>;
+	using RingQueue = BasicQueue<RingPolicy<1 << 16>, double>;
+	Report report(argc, argv);
+
+	if (report.table("producers_to_consumer", "producers", {"spinlock msg/s", "ring msg/s"}))
+		for (unsigned num_producers : {1u, 2u, 4u, 8u, 16u})
+		{
+			const double spinlock = producers_to_consumer<SpinlockQueue>(num_producers);
+			const double ring = producers_to_consumer<RingQueue>(num_producers);
+			report.row(std::to_string(num_producers), {spinlock, ring});
+		}
+
+	if (report.table("stats_overhead", "producers", {"plain msg/s", "stats msg/s"}))
+		for (unsigned num_producers : {1u, 4u})
+		{
+			const double plain = producers_to_consumer<SpinlockQueue>(num_producers);
+			const double stats =
+				producers_to_consumer<BasicQueue<StatsPolicy<>, double>>(num_producers);
+			report.row(std::to_string(num_producers), {plain, stats});
+		}
+
+	if (report.table("latency_overhead", "producers",
+		{"plain msg/s", "steady msg/s", "coarse msg/s", "tsc msg/s"}))
+		for (unsigned num_producers : {1u, 4u})
+		{
+			const double plain = producers_to_consumer<SpinlockQueue>(num_producers);
+			const double steady = producers_to_consumer<
+				BasicQueue<LatencyPolicy<DefaultPolicy, SteadyClock>, double>>(num_producers);
+			const double coarse = producers_to_consumer<
+				BasicQueue<LatencyPolicy<DefaultPolicy, CoarseClock>, double>>(num_producers);
+			const double tsc = producers_to_consumer<
+				BasicQueue<LatencyPolicy<DefaultPolicy, TscClock>, double>>(num_producers);
+			report.row(std::to_string(num_producers), {plain, steady, coarse, tsc});
+		}
+
+	if (report.table("batched_producers_to_consumer", "batch", {"spinlock msg/s", "ring msg/s"}))
+		for (unsigned batch_size : {1u, 8u, 64u, 512u})
+		{
+			const double spinlock = batched_producers_to_consumer<SpinlockQueue>(batch_size);
+			const double ring = batched_producers_to_consumer<RingQueue>(batch_size);
+			report.row(std::to_string(batch_size), {spinlock, ring});
+		}
+
+	if (report.table("large_producers_to_consumer", "producers",
+		{"copy-lock msg/s", "spinlock msg/s"}))
+		for (unsigned num_producers : {1u, 2u, 4u, 8u})
+		{
+			const double copy_lock = large_producers_to_consumer<
+				CopyUnderLockQueue<SpinlockQueue>, SpinlockQueue>(num_producers);
+			const double spinlock =
+				large_producers_to_consumer<SpinlockQueue, SpinlockQueue>(num_producers);
+			report.row(std::to_string(num_producers), {copy_lock, spinlock});
+		}
+
+	if (report.table("lua_to_cpp", "depth", {"trial conv/s", "switch conv/s"}))
+		for (unsigned depth : {2u, 4u, 6u})
+		{
+			const double trial = lua_to_cpp<CustomQueue::Item>(depth);
+			const double type_switch = lua_to_cpp<Owned<CustomQueue::Item>>(depth);
+			report.row(std::to_string(depth), {trial, type_switch});
+		}
+
+	if (report.table("cpp_to_lua", "fields", {"wrapper conv/s", "presized conv/s"}))
+		for (unsigned num_fields : {10u, 100u, 1000u})
+		{
+			const double wrapper = cpp_to_lua<Unwrapped>(num_fields);
+			const double presized = cpp_to_lua<Owned>(num_fields);
+			report.row(std::to_string(num_fields), {wrapper, presized});
+		}
+
+	if (report.table("frame_to_lua", "elements", {"vec frame/s", "dense frame/s"}))
+		for (unsigned num_elements : {100u, 1000u, 10000u})
+		{
+			const double vec = frame_to_lua(num_elements, false);
+			const double dense = frame_to_lua(num_elements, true);
+			report.row(std::to_string(num_elements), {vec, dense});
+		}
+
+	if (report.table("small_message_copy_get", "keys", {"unordered msg/s", "flat msg/s"}))
+		for (unsigned num_keys : {3u, 5u, 8u, 16u})
+		{
+			const double unordered =
+				small_message_copy_get<BasicQueue<UnorderedMapPolicy, double>>(num_keys);
+			const double flat = small_message_copy_get<SpinlockQueue>(num_keys);
+			report.row(std::to_string(num_keys), {unordered, flat});
+		}
+
+	if (report.table("field_access", "key length", {"by Key get/s", "direct get/s"}))
+		for (unsigned key_length : {4u, 12u, 32u})
+		{
+			const double by_key = field_access(key_length, true);
+			const double direct = field_access(key_length, false);
+			report.row(std::to_string(key_length), {by_key, direct});
+		}
+
+	if (report.table("fixed_shape_round_trip", "shape", {"map trip/s", "schema trip/s"}))
+		for (unsigned run = 0; run < 3; run++)
+		{
+			const double map = fixed_shape_round_trip(false);
+			const double schema = fixed_shape_round_trip(true);
+			report.row("pose", {map, schema});
+		}
+
+	if (report.table("route_by_type", "payload", {"eager route/s", "lazy route/s"}))
+		for (unsigned num_fields : {4u, 32u, 256u})
+		{
+			const double eager = route_by_type(num_fields, false);
+			const double lazy = route_by_type(num_fields, true);
+			report.row(std::to_string(num_fields), {eager, lazy});
+		}
+
+	if (report.table("push_then_pop", "payload",
+		{"eager push/s", "tape push/s", "eager pop/s", "tape pop/s"}))
+		for (unsigned num_fields : {4u, 32u, 256u})
+		{
+			const auto eager = push_then_pop<SpinlockQueue>(num_fields);
+			const auto tape = push_then_pop<BasicQueue<TapePolicy<>, double>>(num_fields);
+			report.row(std::to_string(num_fields),
+				{eager.first, tape.first, eager.second, tape.second});
+		}
+
+	if (report.table("shape_conversion", "shape",
+		{"to lua conv/s", "from lua conv/s", "lua push+pop/s"}))
+		for (const std::string& shape : Shapes)
+		{
+			const double to_lua = shape_conversion(shape, "to lua");
+			const double from_lua = shape_conversion(shape, "from lua");
+			const double lua_push_pop = shape_conversion(shape, "lua push+pop");
+			report.row(shape, {to_lua, from_lua, lua_push_pop});
+		}
+
+	if (report.table("push_to_pop_latency", "consumer",
+		{"p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns"}))
+		for (bool lua : {false, true})
+		{
+			const std::vector<double> latencies = push_to_pop_latencies(lua);
+			report.row(lua ? "lua" : "c++", {
+				percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99),
+				percentile(latencies, 99.9), latencies.back()
+			});
+		}
+
+	report.finish();
+	return 0;
+}
@@ -1,12 +1,89 @@
 #include "catch.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
 #include <thread>
+#include <poll.h>
+#include <unistd.h>
 #include <LuaCppMsg.hpp>
 
 using namespace LuaCppMsg;
 
 extern lua_State* L;
 
+/// Number of allocations made through the global `operator new`, for counting copies.
+static std::atomic<std::size_t> num_allocs{0};
+
+void* operator new (std::size_t size_)
+{
+	num_allocs.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size_ ? size_ : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete (void* p_) noexcept
+{
+	std::free(p_);
+}
+
+void operator delete (void* p_, std::size_t) noexcept
+{
+	std::free(p_);
+}
+
+/**
+ * Count the allocations made by a callable.
+ *
+ * @param fn_ callable to run.
+ * @return number of calls to the global `operator new` while running `fn_`.
+ */
+template <class Fn>
+std::size_t count_allocs (Fn fn_)
+{
+	const std::size_t before = num_allocs;
+	fn_();
+	return num_allocs - before;
+}
+
+/**
+ * Check whether a file descriptor is readable, without waiting.
+ */
+static bool readable (int fd_)
+{
+	pollfd pfd{ fd_, POLLIN, 0 };
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+/// A value counting how often it is moved, for pinning down container behaviour.
+struct MoveCounted
+{
+	explicit MoveCounted (int value_) : value(value_) {}
+	MoveCounted (MoveCounted&& other_) : value(other_.value) { num_moves++; }
+	MoveCounted& operator= (MoveCounted&& other_) { value = other_.value; num_moves++; return *this; }
+	int value;
+	static unsigned num_moves;
+};
+unsigned MoveCounted::num_moves = 0;
+
+/// A custom type without a default constructor.
+struct Handle
+{
+	explicit Handle (int id_) : id(id_) {}
+	int id;
+};
+
+/// A message with a fixed shape, carried as a struct.
+struct Pose
+{
+	int id = 0;
+	double x = 0;
+	std::string frame;
+};
+LUACPPMSG_SCHEMA(Pose, id, x, frame)
+
 
 SCENARIO("Push and pop from C++")
 {
@@ -208,6 +285,18 @@ SCENARIO("Push and pop from Lua")
 			}
 		}
 
+		WHEN("we push a string that looks like a number to the queue")
+		{
+			lua->executeCode("lqueue:push({str=\"12\", num=12})");
+
+			THEN("the string is kept as a string and the number as a number")
+			{
+				SimpleQueue::Msg msg = *queue.pop();
+				CHECK(msg.get("str").as<SimpleQueue::Str>() == "12");
+				CHECK(msg.get("num").as<double>() == 12);
+			}
+		}
+
 		WHEN("we push a table to the queue")
 		{
 			lua->executeCode(
@@ -275,6 +364,198 @@ SCENARIO("Push and pop between C++ and Lua")
 			}
 		}
 
+		WHEN("we push a sequence to the queue from Lua")
+		{
+			lua->executeCode("lqueue:push({1.5, \"two\", {3.5}, {x=4.5}})");
+
+			AND_WHEN("we pop the vector from the queue from C++")
+			{
+				SimpleQueue::Msg msg = *queue.pop();
+
+				THEN("the sequence and nested sequences are vectors indexed from 1")
+				{
+					CHECK(msg.as<SimpleQueue::Vec>().size() == 4);
+					CHECK(msg.get(1).as<double>() == 1.5);
+					CHECK(msg.get(2).as<SimpleQueue::Str>() == "two");
+					CHECK(msg.get(3).as<SimpleQueue::Vec>().size() == 1);
+					CHECK(msg.get(3).get(1).as<double>() == 3.5);
+					CHECK(msg.get(4).get("x").as<double>() == 4.5);
+				}
+			}
+		}
+
+		WHEN("we push a table with holes to the queue from Lua")
+		{
+			lua->executeCode("lqueue:push({[1]=1.5, [3]=3.5})");
+
+			THEN("it is popped in C++ as a map")
+			{
+				SimpleQueue::Msg msg = *queue.pop();
+				CHECK(msg.as<SimpleQueue::Map>().size() == 2);
+				CHECK(msg.get(3).as<double>() == 3.5);
+			}
+		}
+
+		WHEN("we push a vector to the queue from C++")
+		{
+			queue.push(SimpleQueue::Vec{ 1.5, SimpleQueue::Vec{ 2.5, 3.5 } });
+
+			AND_WHEN("we pop the table from the queue from Lua")
+			{
+				lua->executeCode(
+					"item = lqueue:pop()\n"
+					"len = #item\n"
+					"nested_len = #item[2]\n"
+					"nested = item[2][2]"
+				);
+
+				THEN("it is a sequence")
+				{
+					CHECK(lua->readVariable<int>("len") == 2);
+					CHECK(lua->readVariable<int>("nested_len") == 2);
+					CHECK(lua->readVariable<double>("nested") == 3.5);
+				}
+			}
+		}
+
+		WHEN("we push a dense array of numbers to the queue from C++")
+		{
+			SimpleQueue::Dense frame(std::vector<float>{ 1.5f, 2.5f, 3.5f });
+			const void* data = frame.data();
+			queue.push(frame);
+
+			AND_WHEN("we pop the array from the queue from Lua")
+			{
+				lua->executeCode(
+					"frame = lqueue:pop()\n"
+					"len = #frame\n"
+					"second = frame[2]\n"
+					"out_of_range = frame[4] == nil\n"
+					"fractional = frame[1.5] == nil\n"
+					"elem_type = frame.type\n"
+					"ptr = frame.ptr"
+				);
+
+				THEN("the elements can be read without converting the array")
+				{
+					CHECK(lua->readVariable<int>("len") == 3);
+					CHECK(lua->readVariable<double>("second") == 2.5);
+					CHECK(lua->readVariable<bool>("out_of_range"));
+					CHECK(lua->readVariable<std::string>("elem_type") == "float");
+					lua_getglobal(L, "ptr");
+					CHECK(lua_islightuserdata(L, -1));
+					CHECK(lua_touserdata(L, -1) == data);
+					lua_pop(L, 1);
+				}
+
+				THEN("indices that aren't integers give nil, as for a table")
+				{
+					CHECK(lua->readVariable<bool>("fractional"));
+				}
+
+				THEN("its metamethods raise a Lua error rather than crashing on anything else")
+				{
+					lua_getglobal(L, "frame");
+					REQUIRE(lua_getmetatable(L, -1));
+					lua_getfield(L, -1, "__index");
+					lua_pushnumber(L, 5);
+					lua_pushnumber(L, 1);
+					CHECK(lua_pcall(L, 2, 1, 0) != 0);
+					lua_pop(L, 3);
+				}
+
+				AND_WHEN("we push the array back from Lua and pop it from C++")
+				{
+					lua->executeCode("lqueue:push({frame=frame})");
+					SimpleQueue::Msg msg = *queue.pop();
+					const SimpleQueue::Dense popped = msg.get("frame").as<SimpleQueue::Dense>();
+
+					THEN("the elements are shared rather than copied")
+					{
+						CHECK(popped.data<float>() == data);
+						CHECK(popped.data<float>()[2] == 3.5f);
+						CHECK_THROWS_AS(popped.data<double>(), const std::bad_cast&);
+					}
+				}
+			}
+		}
+
+		WHEN("we push a binary blob to the queue from C++")
+		{
+			SimpleQueue::Blob blob(std::string("bin\0ary", 6));
+			const char* data = blob.data();
+			queue.push(blob);
+
+			AND_WHEN("we pop the blob from the queue from Lua")
+			{
+				lua->executeCode(
+					"blob = lqueue:pop()\n"
+					"len = #blob\n"
+					"ptr = blob.ptr"
+				);
+
+				THEN("the bytes are shared rather than copied")
+				{
+					CHECK(lua->readVariable<int>("len") == 6);
+					lua_getglobal(L, "ptr");
+					CHECK(lua_touserdata(L, -1) == data);
+					lua_pop(L, 1);
+				}
+
+				THEN("the bytes can be copied to a Lua string on request")
+				{
+					lua->executeCode("str = blob:tostring()");
+					lua_getglobal(L, "str");
+					std::size_t len = 0;
+					const char* str = lua_tolstring(L, -1, &len);
+					CHECK(std::string(str, len) == std::string("bin\0ary", 6));
+					lua_pop(L, 1);
+				}
+
+				THEN("calling its method without the blob raises a Lua error rather than crashing")
+				{
+					CHECK_THROWS_AS(lua->executeCode("blob.tostring()"),
+						const LuaContext::ExecutionErrorException&);
+				}
+
+				AND_WHEN("we push the blob back from Lua and pop it from C++")
+				{
+					lua->executeCode("lqueue:push(blob)");
+					SimpleQueue::Blob popped = queue.pop()->as<SimpleQueue::Blob>();
+
+					THEN("the bytes are still shared")
+					{
+						CHECK(popped.data() == data);
+						CHECK(popped.size() == 6);
+					}
+				}
+			}
+		}
+
+		WHEN("we push a map with both array and hash keys to the queue from C++")
+		{
+			queue.push(SimpleQueue::Map{
+				{ 1, 1.5 }, { 2, 2.5 }, { 3, 3.5 }, { 10, 10.5 }, { "name", SimpleQueue::Str("wide") }
+			});
+
+			AND_WHEN("we pop the table from the queue from Lua")
+			{
+				lua->executeCode(
+					"item = lqueue:pop()\n"
+					"len = #item\n"
+					"sum = item[1] + item[2] + item[3] + item[10]"
+				);
+
+				THEN("the array part is a sequence and every entry is present")
+				{
+					CHECK(lua->readVariable<int>("len") == 3);
+					CHECK(lua->readVariable<double>("sum") == 18);
+					lua->executeCode("name = item.name");
+					CHECK(lua->readVariable<SimpleQueue::Str>("name") == "wide");
+				}
+			}
+		}
+
 		WHEN("we push a number to the queue from C++")
 		{
 			queue.push(5.4);
@@ -472,101 +753,1622 @@ SCENARIO("Multithreaded push/pop")
 }
 
 
-struct CustomType
+SCENARIO("Bounded queue")
 {
-	CustomType()
-	{
-		vals = nullptr;
-	}
-	CustomType(const CustomType& other_)
-	{
-		val = other_.val;
-		vals = new int[1];
-		vals[0] = other_.vals[0];
-	}
-	CustomType(CustomType&& other_)
+	GIVEN("a queue with a capacity of 2")
 	{
-		val = other_.val;
-		vals = other_.vals;
-		other_.vals = nullptr;
-	}
+		using SimpleQueue = Queue<double>;
+		SimpleQueue queue(L, "lqueue");
+		SimpleQueue::Lua lua = queue.lua();
+		queue.set_capacity(2);
 
-	CustomType& operator=(const CustomType& other_)
-	{
-		val = other_.val;
-		vals = other_.vals;
-	}
+		THEN("the capacity is 2")
+		{
+			CHECK(queue.capacity() == 2);
+		}
 
-	CustomType(int val_) : val(val_)
-	{
-		vals = new int[1];
-		vals[0] = val_;
+		WHEN("we fill the queue")
+		{
+			CHECK(queue.try_push(1.0));
+			CHECK(queue.try_push(2.0));
+
+			THEN("further attempts to push fail")
+			{
+				CHECK(!queue.try_push(3.0));
+				CHECK(queue.size() == 2);
+			}
+
+			THEN("a timed push gives up after the timeout")
+			{
+				CHECK(!queue.push_for(3.0, std::chrono::milliseconds(10)));
+				CHECK(queue.size() == 2);
+			}
+
+			THEN("Lua's try_push returns false")
+			{
+				lua->executeCode("pushed = lqueue:try_push(3)");
+				CHECK(!lua->readVariable<bool>("pushed"));
+			}
+
+			AND_WHEN("a producer blocks on push until a consumer pops")
+			{
+				std::thread producer([&queue]() {
+					queue.push(3.0);
+				});
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				SimpleQueue::Msg msg = *queue.pop();
+				producer.join();
+
+				THEN("the blocked message was appended")
+				{
+					CHECK(msg.as<double>() == 1.0);
+					CHECK(queue.size() == 2);
+					CHECK(queue.pop()->as<double>() == 2.0);
+					CHECK(queue.pop()->as<double>() == 3.0);
+				}
+			}
+
+			AND_WHEN("we remove the capacity limit")
+			{
+				queue.set_capacity(0);
+
+				THEN("we can push again")
+				{
+					CHECK(queue.try_push(3.0));
+					CHECK(queue.size() == 3);
+				}
+			}
+		}
+
+		WHEN("we try to push from Lua to a queue with space")
+		{
+			lua->executeCode("pushed = lqueue:try_push(3)");
+
+			THEN("try_push returns true")
+			{
+				CHECK(lua->readVariable<bool>("pushed"));
+				CHECK(queue.pop()->as<double>() == 3);
+			}
+		}
 	}
-	~CustomType()
+
+	GIVEN("a ring buffer queue with a capacity smaller than its number of slots")
 	{
-		delete[] vals;
+		using RingQueue = BasicQueue<RingPolicy<16>, double>;
+		RingQueue queue;
+		queue.set_capacity(2);
+
+		THEN("pushes fail once the capacity is reached")
+		{
+			CHECK(queue.capacity() == 2);
+			CHECK(queue.try_push(1.0));
+			CHECK(queue.try_push(2.0));
+			CHECK(!queue.try_push(3.0));
+		}
 	}
-	int val;
-	int* vals;
-};
+}
 
 
-SCENARIO("Custom types")
+SCENARIO("Blocking pop")
 {
-	GIVEN("a queue with messages allowing a custom type")
+	GIVEN("an empty queue")
 	{
-		using ExQueue = Queue<CustomType>;
-		ExQueue queue(L, "lqueue");
-		ExQueue::Lua lua = queue.lua();
-		lua->registerMember("val", &CustomType::val);
+		using SimpleQueue = Queue<double>;
+		SimpleQueue queue;
 
-		WHEN("we push and pop in C++")
+		WHEN("we pop with a timeout")
 		{
-			queue.push(CustomType(3));
-			ExQueue::Msg msg = *queue.pop();
+			SimpleQueue::Opt msg_exists = queue.pop_for(std::chrono::milliseconds(10));
 
-			THEN("the value is correct")
+			THEN("the message evaluates as falsey")
 			{
-				CHECK(msg.as<CustomType>().val == 3);
+				CHECK(!msg_exists);
 			}
 		}
 
-		WHEN("we push and pop in Lua")
+		WHEN("a consumer waits for a message that a producer later pushes")
 		{
-			CustomType custom(7);
-
-			lua->writeVariable("lcustom", custom);
-			lua->executeCode(
-				"val_before = lcustom.val\n"
-				"lqueue:push(lcustom)\n"
-				"lcustom_popped = lqueue:pop()\n"
-				"val_after = lcustom_popped.val\n"
-			);
+			double value = 0;
+			std::thread consumer([&queue, &value]() {
+				value = queue.pop_wait().as<double>();
+			});
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			queue.push(5.4);
+			consumer.join();
 
-			THEN("the value is correct")
+			THEN("the consumer receives the message")
 			{
-				int val_before = lua->readVariable<int>("val_before");
-				int val_after = lua->readVariable<int>("val_after");
-
-				CHECK(val_before == 7);
-				CHECK(val_after == 7);
+				CHECK(value == 5.4);
+				CHECK(queue.size() == 0);
 			}
 		}
 
-		WHEN("we push in C++ and pop in Lua")
+		WHEN("several consumers wait on a burst of messages")
 		{
-			queue.push(CustomType(5));
+			std::atomic<unsigned> num_popped{0};
+			std::array<std::thread, 4> consumers;
+			for (std::thread& t : consumers)
+				t = std::thread([&queue, &num_popped]() {
+					for (unsigned i = 0; i < 250; i++)
+					{
+						queue.pop_wait();
+						num_popped++;
+					}
+				});
 
-			lua->executeCode(
-				"lcustom_popped = lqueue:pop()\n"
-				"val = lcustom_popped.val\n"
-			);
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			for (unsigned i = 0; i < 1000; i++)
+				queue.push(double(i));
+			for (std::thread& t : consumers)
+				t.join();
 
-			THEN("the value is correct")
+			THEN("every message is consumed")
 			{
-				int val = lua->readVariable<int>("val");
+				CHECK(num_popped == 1000);
+				CHECK(queue.size() == 0);
+			}
+		}
+	}
 
-				CHECK(val == 5);
+	GIVEN("an empty ring buffer queue")
+	{
+		using RingQueue = BasicQueue<RingPolicy<16>, double>;
+		RingQueue queue;
+
+		WHEN("a consumer waits for a message that a producer later pushes")
+		{
+			double value = 0;
+			std::thread consumer([&queue, &value]() {
+				value = queue.pop_wait().as<double>();
+			});
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			queue.push(5.4);
+			consumer.join();
+
+			THEN("the consumer receives the message")
+			{
+				CHECK(value == 5.4);
+			}
+		}
+
+		WHEN("several consumers wait on messages from several producers")
+		{
+			std::atomic<unsigned> num_popped{0};
+			std::array<std::thread, 3> consumers;
+			for (std::thread& t : consumers)
+				t = std::thread([&queue, &num_popped]() {
+					for (unsigned i = 0; i < 2000; i++)
+					{
+						queue.pop_wait();
+						num_popped++;
+					}
+				});
+			std::array<std::thread, 3> producers;
+			for (std::thread& t : producers)
+				t = std::thread([&queue]() {
+					for (unsigned i = 0; i < 2000; i++)
+					{
+						queue.push(double(i));
+						if (i % 64 == 0)
+							std::this_thread::yield();
+					}
+				});
+			for (std::thread& t : producers)
+				t.join();
+			for (std::thread& t : consumers)
+				t.join();
+
+			THEN("every message is consumed, with no consumer left waiting")
+			{
+				CHECK(num_popped == 6000);
+				CHECK(queue.size() == 0);
+			}
+		}
+	}
+}
+
+
+SCENARIO("Bulk push and pop")
+{
+	GIVEN("a queue")
+	{
+		using SimpleQueue = Queue<double>;
+		SimpleQueue queue;
+
+		WHEN("we push a batch of messages")
+		{
+			std::vector<SimpleQueue::Map> maps{
+				{{"value", 1.0}}, {{"value", 2.0}}, {{"value", 3.0}}
+			};
+			queue.push_bulk(maps.begin(), maps.end());
+
+			THEN("the queue size is 3")
+			{
+				CHECK(queue.size() == 3);
+			}
+
+			AND_WHEN("we pop a smaller batch")
+			{
+				std::vector<SimpleQueue::Msg> msgs = queue.pop_bulk(2);
+
+				THEN("the first messages are popped in order")
+				{
+					REQUIRE(msgs.size() == 2);
+					CHECK(msgs[0].get("value").as<double>() == 1.0);
+					CHECK(msgs[1].get("value").as<double>() == 2.0);
+					CHECK(queue.size() == 1);
+				}
+			}
+
+			AND_WHEN("we drain the queue")
+			{
+				std::vector<SimpleQueue::Msg> msgs;
+				std::size_t num = queue.drain_into(msgs);
+
+				THEN("all messages are popped in order")
+				{
+					CHECK(num == 3);
+					REQUIRE(msgs.size() == 3);
+					CHECK(msgs[2].get("value").as<double>() == 3.0);
+					CHECK(queue.size() == 0);
+				}
+			}
+		}
+
+		WHEN("we move a batch larger than the queue's capacity into the queue")
+		{
+			queue.set_capacity(2);
+			std::vector<SimpleQueue::Item> items{1.0, 2.0, 3.0, 4.0, 5.0};
+			std::thread producer([&queue, &items]() {
+				queue.push_bulk(std::move(items));
+			});
+
+			std::vector<SimpleQueue::Msg> msgs;
+			while (msgs.size() < 5)
+				if (!queue.drain_into(msgs))
+					std::this_thread::yield();
+			producer.join();
+
+			THEN("the whole batch arrives in order")
+			{
+				for (unsigned i = 0; i < 5; i++)
+					CHECK(msgs[i].as<double>() == i + 1);
+			}
+		}
+	}
+
+	GIVEN("a ring buffer queue")
+	{
+		using RingQueue = BasicQueue<RingPolicy<4>, double>;
+		RingQueue queue;
+
+		WHEN("we push a batch larger than the ring buffer")
+		{
+			std::vector<double> values{1.0, 2.0, 3.0, 4.0, 5.0, 6.0};
+			std::thread producer([&queue, &values]() {
+				queue.push_bulk(values.begin(), values.end());
+			});
+
+			std::vector<RingQueue::Msg> msgs;
+			while (msgs.size() < 6)
+				for (RingQueue::Msg& msg : queue.pop_bulk(3))
+					msgs.push_back(std::move(msg));
+			producer.join();
+
+			THEN("the whole batch arrives in order")
+			{
+				for (unsigned i = 0; i < 6; i++)
+					CHECK(msgs[i].as<double>() == i + 1);
+			}
+		}
+	}
+}
+
+
+SCENARIO("Bulk push and pop from Lua")
+{
+	GIVEN("a queue bound to Lua containing 3 messages")
+	{
+		using SimpleQueue = Queue<double>;
+		SimpleQueue queue(L, "lqueue");
+		SimpleQueue::Lua lua = queue.lua();
+
+		for (double value : {1.0, 2.0, 3.0})
+			queue.push(SimpleQueue::Map{{"value", value}});
+
+		WHEN("we pop 2 messages at once from Lua")
+		{
+			lua->executeCode(
+				"items = lqueue:pop_many(2)\n"
+				"num_items = #items\n"
+				"first = items[1].value\n"
+				"second = items[2].value"
+			);
+
+			THEN("the first 2 messages are returned in an array")
+			{
+				CHECK(lua->readVariable<int>("num_items") == 2);
+				CHECK(lua->readVariable<double>("first") == 1.0);
+				CHECK(lua->readVariable<double>("second") == 2.0);
+				CHECK(queue.size() == 1);
+			}
+		}
+
+		WHEN("we drain the queue from Lua")
+		{
+			lua->executeCode(
+				"items = lqueue:drain()\n"
+				"num_items = #items\n"
+				"last = items[3].value\n"
+				"num_empty = #lqueue:drain()"
+			);
+
+			THEN("all messages are returned in an array")
+			{
+				CHECK(lua->readVariable<int>("num_items") == 3);
+				CHECK(lua->readVariable<double>("last") == 3.0);
+				CHECK(lua->readVariable<int>("num_empty") == 0);
+				CHECK(queue.size() == 0);
+			}
+		}
+	}
+
+	GIVEN("an empty queue bound to Lua")
+	{
+		using SimpleQueue = Queue<double>;
+		SimpleQueue queue(L, "lqueue");
+		SimpleQueue::Lua lua = queue.lua();
+
+		WHEN("we push an array of messages at once from Lua")
+		{
+			lua->executeCode(
+				"lqueue:push_many({"
+				"  {type=\"MOCK MESSAGE\", nested={[2]=4.9}}, 5.4, \"a string\""
+				"})"
+			);
+
+			THEN("the messages are appended in order")
+			{
+				REQUIRE(queue.size() == 3);
+				SimpleQueue::Msg msg = *queue.pop();
+				CHECK(msg.get("type").as<SimpleQueue::Str>() == "MOCK MESSAGE");
+				CHECK(msg.get("nested").get(2).as<double>() == 4.9);
+				CHECK(queue.pop()->as<double>() == 5.4);
+				CHECK(queue.pop()->as<SimpleQueue::Str>() == "a string");
+			}
+		}
+
+		WHEN("we push an empty array from Lua")
+		{
+			lua->executeCode("lqueue:push_many({})");
+
+			THEN("the queue is still empty")
+			{
+				CHECK(queue.size() == 0);
+			}
+		}
+	}
+}
+
+
+SCENARIO("Each push and pop builds the message tree once")
+{
+	GIVEN("a queue and a nested map in both C++ and Lua")
+	{
+		using SimpleQueue = Queue<double>;
+		SimpleQueue queue(L, "lqueue");
+		SimpleQueue::Lua lua = queue.lua();
+
+		// Strings are long enough to defeat the small string optimisation, so are allocated.
+		SimpleQueue::Map map;
+		for (int i = 1; i <= 4; i++)
+		{
+			SimpleQueue::Map sub;
+			for (int j = 1; j <= 4; j++)
+				sub[j] = SimpleQueue::Str("a string too long to be stored inline");
+			sub["num"] = double(i);
+			map[i] = std::move(sub);
+		}
+		const SimpleQueue::Item item(map);
+
+		lua->executeCode(
+			"t = {}"
+			"for i = 1, 4 do"
+			"  t[i] = {num = i}"
+			"  for j = 1, 4 do t[i][j] = 'a string too long to be stored inline' end "
+			"end"
+		);
+
+		WHEN("we push the map from C++")
+		{
+			const std::size_t build = count_allocs([&item]() { SimpleQueue::Item copy(item); });
+			const std::size_t push = count_allocs([&queue, &item]() { queue.push(item); });
+
+			THEN("the push costs a single copy of the tree plus a constant")
+			{
+				CHECK(push <= build + 2);
+				CHECK(queue.pop()->get(4).get(1).as<SimpleQueue::Str>() ==
+					"a string too long to be stored inline");
+			}
+		}
+
+		WHEN("we push the table from Lua")
+		{
+			const std::size_t read = count_allocs([&lua]() {
+				lua->readVariable<SimpleQueue::Item>("t");
+			});
+			const std::size_t call = count_allocs([&lua]() { lua->executeCode("lqueue:size()"); });
+			const std::size_t push = count_allocs([&lua]() { lua->executeCode("lqueue:push(t)"); });
+
+			THEN("the push costs a single conversion of the table plus a constant")
+			{
+				CHECK(push <= call + read + 2);
+				CHECK(queue.pop()->get(4).get("num").as<double>() == 4);
+			}
+		}
+
+		WHEN("we pop the map from Lua")
+		{
+			queue.push(item);
+			const std::size_t call = count_allocs([&lua]() { lua->executeCode("lqueue:size()"); });
+			const std::size_t pop = count_allocs([&lua]() {
+				lua->executeCode("popped = lqueue:pop()");
+			});
+
+			THEN("the map is converted without being copied")
+			{
+				CHECK(pop <= call + 4);
+				lua->executeCode("str = popped[4][1]");
+				CHECK(lua->readVariable<std::string>("str") ==
+					"a string too long to be stored inline");
+			}
+		}
+	}
+}
+
+
+SCENARIO("Map representations")
+{
+	GIVEN("a small message with the default flat map")
+	{
+		using SimpleQueue = Queue<double>;
+		SimpleQueue queue(L, "lqueue");
+		SimpleQueue::Lua lua = queue.lua();
+
+		const SimpleQueue::Item item(SimpleQueue::Map{
+			{ "type", SimpleQueue::Str("pose") }, { "x", 1.5 }, { "y", 2.5 }, { "z", 3.5 }, { 1, 4.5 }
+		});
+
+		THEN("copying the message allocates only the entries and the variant's wrapper")
+		{
+			const std::size_t num = count_allocs([&item]() { SimpleQueue::Item copy(item); });
+			CHECK(num == 2);
+		}
+
+		WHEN("we pass it through Lua and back")
+		{
+			queue.push(item);
+			lua->executeCode("lqueue:push(lqueue:pop())");
+			SimpleQueue::Msg msg = *queue.pop();
+
+			THEN("every entry is present")
+			{
+				CHECK(msg.as<SimpleQueue::Map>().size() == 5);
+				CHECK(msg.get("type").as<SimpleQueue::Str>() == "pose");
+				CHECK(msg.get("z").as<double>() == 3.5);
+				CHECK(msg.get(1).as<double>() == 4.5);
+			}
+		}
+	}
+
+	GIVEN("a message with keys longer than the small string buffer")
+	{
+		using SimpleQueue = Queue<double>;
+		const std::string long_key = "a_field_name_longer_than_any_small_string_buffer";
+		const SimpleQueue::Msg msg(SimpleQueue::Item(SimpleQueue::Map{
+			{ long_key, SimpleQueue::Map{{ long_key, 1.5 }, { 3, 2.5 }} }
+		}));
+
+		THEN("looking them up by any string type or int doesn't allocate")
+		{
+			double value = 0;
+			const std::size_t num = count_allocs([&]() {
+				value += msg.get(long_key.c_str()).get(long_key).as<double>();
+				value += msg.get(boost::string_view(long_key)).get(3).as<double>();
+			});
+			CHECK(num == 0);
+			CHECK(value == 4.0);
+		}
+
+		THEN("missing keys throw")
+		{
+			CHECK_THROWS_AS(msg.get("missing"), const std::out_of_range&);
+			CHECK_THROWS_AS(msg.get(long_key).get(4), const std::out_of_range&);
+			CHECK_THROWS_AS(msg.get(-1), const std::out_of_range&);
+		}
+	}
+
+	GIVEN("entries out of key order, with a duplicate key")
+	{
+		using CountedMap = FlatMap<int, MoveCounted>;
+		std::vector<CountedMap::value_type> entries;
+		entries.reserve(101);
+		for (int i = 100; i > 0; i--)
+			entries.emplace_back(i, MoveCounted(i * 10));
+		entries.emplace_back(50, MoveCounted(-1));
+
+		WHEN("we construct a flat map from them in bulk")
+		{
+			MoveCounted::num_moves = 0;
+			const CountedMap map(std::move(entries));
+
+			THEN("they are sorted, the first duplicate is kept, and each kept value moved once")
+			{
+				CHECK(map.size() == 100);
+				CHECK(map.begin()->first == 1);
+				CHECK(map.at(50).value == 500);
+				CHECK(MoveCounted::num_moves == 100);
+			}
+		}
+
+		WHEN("we construct a flat map from them already in key order")
+		{
+			entries.pop_back();
+			std::reverse(entries.begin(), entries.end());
+			MoveCounted::num_moves = 0;
+			const CountedMap map(std::move(entries));
+
+			THEN("the entries are adopted without moving any")
+			{
+				CHECK(map.size() == 100);
+				CHECK(map.at(100).value == 1000);
+				CHECK(MoveCounted::num_moves == 0);
+			}
+		}
+	}
+
+	GIVEN("narrow and wide tables in Lua")
+	{
+		using SimpleQueue = Queue<double>;
+		SimpleQueue queue(L, "lqueue");
+		SimpleQueue::Lua lua = queue.lua();
+		lua->executeCode(
+			"narrow, wide, nested = {}, {}, {}"
+			"for i = 1, 8 do narrow['key' .. i] = i end "
+			"for i = 1, 512 do wide['key' .. i] = i nested['key' .. i] = {x = i} end"
+		);
+
+		WHEN("we push them")
+		{
+			const std::size_t narrow = count_allocs([&lua]() { lua->executeCode("lqueue:push(narrow)"); });
+			const std::size_t wide = count_allocs([&lua]() { lua->executeCode("lqueue:push(wide)"); });
+			const std::size_t nested = count_allocs([&lua]() { lua->executeCode("lqueue:push(nested)"); });
+			queue.pop();
+			SimpleQueue::Msg msg = *queue.pop();
+
+			THEN("a table of scalars costs the same whatever its width, and nested ones a few each")
+			{
+				CHECK(wide == narrow);
+				CHECK(nested <= wide + 512 * 6);
+				CHECK(msg.get("key512").as<double>() == 512);
+			}
+		}
+	}
+
+	GIVEN("a queue using std::unordered_map for its maps")
+	{
+		using UnorderedQueue = BasicQueue<UnorderedMapPolicy, double>;
+		UnorderedQueue queue(L, "lqueue");
+		UnorderedQueue::Lua lua = queue.lua();
+
+		WHEN("we pass a nested map through Lua and back")
+		{
+			queue.push(UnorderedQueue::Map{{ "nested", UnorderedQueue::Map{{ 2, 4.9 }} }});
+			lua->executeCode("lqueue:push(lqueue:pop())");
+			UnorderedQueue::Msg msg = *queue.pop();
+
+			THEN("the map is correct, whatever the key type")
+			{
+				CHECK(msg.get("nested").get(2).as<double>() == 4.9);
+				CHECK(msg.get(std::string("nested")).get(UnorderedQueue::Key(2)).as<double>() == 4.9);
+				CHECK(msg.get(boost::string_view("nested")).get(2).as<double>() == 4.9);
+			}
+		}
+	}
+}
+
+
+SCENARIO("String keys from Lua")
+{
+	GIVEN("a queue")
+	{
+		using SimpleQueue = Queue<double>;
+		SimpleQueue queue(L, "lqueue");
+		SimpleQueue::Lua lua = queue.lua();
+
+		WHEN("we push a table with short, long and binary string keys from Lua")
+		{
+			lua->executeCode(
+				"lqueue:push({type='pose', a_field_name_longer_than_any_small_string_buffer=1.5,"
+				"  ['a\\0b']=2.5, nested={value=3.5, [3]=4}})"
+			);
+			SimpleQueue::Msg msg = *queue.pop();
+
+			THEN("every key is read in full")
+			{
+				CHECK(msg.as<SimpleQueue::Map>().size() == 4);
+				CHECK(msg.get("type").as<SimpleQueue::Str>() == "pose");
+				CHECK(msg.get("a_field_name_longer_than_any_small_string_buffer").as<double>() == 1.5);
+				CHECK(msg.get(std::string("a\0b", 3)).as<double>() == 2.5);
+				CHECK(msg.get("nested").get("value").as<double>() == 3.5);
+				CHECK(msg.get("nested").get(3).as<double>() == 4);
+			}
+		}
+	}
+}
+
+
+SCENARIO("Schema'd messages")
+{
+	GIVEN("a queue of a schema'd struct, with its Lua constructor bound")
+	{
+		using PoseQueue = Queue<double, Pose>;
+		PoseQueue queue(L, "lqueue");
+		PoseQueue::Lua lua = queue.lua();
+		bind_schema<Pose>(L, "Pose");
+
+		WHEN("we push a struct in C++")
+		{
+			queue.push(Pose{ 3, 1.5, "map" });
+
+			THEN("it's popped in C++ as the struct")
+			{
+				const Pose pose = queue.pop()->as<Pose>();
+				CHECK(pose.id == 3);
+				CHECK(pose.x == 1.5);
+				CHECK(pose.frame == "map");
+			}
+
+			THEN("it's popped in Lua as a table of its fields, and pushed back as the struct")
+			{
+				lua->executeCode("pose = lqueue:pop() id = pose.id x = pose.x frame = pose.frame");
+				CHECK(lua->readVariable<int>("id") == 3);
+				CHECK(lua->readVariable<double>("x") == 1.5);
+				CHECK(lua->readVariable<std::string>("frame") == "map");
+
+				lua->executeCode("pose.x = 2.5 lqueue:push(pose)");
+				const Pose pose = queue.pop()->as<Pose>();
+				CHECK(pose.id == 3);
+				CHECK(pose.x == 2.5);
+			}
+		}
+
+		WHEN("we push a struct nested in a map in C++, and pass it through Lua")
+		{
+			queue.push(PoseQueue::Map{{ "pose", Pose{ 4, 0.5, "odom" } }});
+			lua->executeCode("lqueue:push(lqueue:pop())");
+			PoseQueue::Msg msg = *queue.pop();
+
+			THEN("it's still the struct")
+			{
+				CHECK(msg.get("pose").as<Pose>().frame == "odom");
+			}
+		}
+
+		WHEN("we push a table built by the constructor from Lua")
+		{
+			lua->executeCode("lqueue:push(Pose{ id = 5, x = 6.5, other = 'ignored' })");
+			PoseQueue::Msg msg = *queue.pop();
+
+			THEN("it's popped as the struct, with missing fields defaulted")
+			{
+				const Pose& pose = msg.as<Pose>();
+				CHECK(pose.id == 5);
+				CHECK(pose.x == 6.5);
+				CHECK(pose.frame.empty());
+			}
+		}
+
+		WHEN("we push a plain table with the same fields from Lua")
+		{
+			lua->executeCode("lqueue:push({ id = 5, x = 6.5 })");
+
+			THEN("it's popped as a map")
+			{
+				PoseQueue::Msg msg = *queue.pop();
+				CHECK(msg.get("x").as<double>() == 6.5);
+			}
+		}
+
+		WHEN("we push a struct with a field of the wrong type from Lua")
+		{
+			THEN("the push fails")
+			{
+				CHECK_THROWS(lua->executeCode("lqueue:push(Pose{ id = 'five' })"));
+				CHECK(queue.size() == 0);
+			}
+		}
+	}
+}
+
+
+SCENARIO("Lazy pop in Lua")
+{
+	GIVEN("a queue with a nested message")
+	{
+		using SimpleQueue = Queue<double>;
+		SimpleQueue queue(L, "lqueue");
+		SimpleQueue::Lua lua = queue.lua();
+		queue.push(SimpleQueue::Map{
+			{ "type", SimpleQueue::Str("pose") },
+			{ "payload", SimpleQueue::Map{{ "x", 1.5 }, { 1, 2.5 }, { 2, 3.5 }} },
+			{ "list", SimpleQueue::Vec{ 4.5, SimpleQueue::Str("five") } }
+		});
+
+		WHEN("we pop it lazily and read some fields")
+		{
+			lua->executeCode(
+				"msg = lqueue:pop_lazy() "
+				"t = msg.type x = msg.payload.x n = #msg.list e = msg.list[2] "
+				"plen = #msg.payload missing = msg.nope missing_idx = msg.list[3] "
+				"same = msg.payload == msg.payload"
+			);
+
+			THEN("the fields are converted on access")
+			{
+				CHECK(lua->readVariable<std::string>("t") == "pose");
+				CHECK(lua->readVariable<double>("x") == 1.5);
+				CHECK(lua->readVariable<int>("n") == 2);
+				CHECK(lua->readVariable<std::string>("e") == "five");
+				CHECK(lua->readVariable<int>("plen") == 2);
+				CHECK(lua->readVariable<bool>("same"));
+				lua_getglobal(L, "missing");
+				lua_getglobal(L, "missing_idx");
+				CHECK(lua_isnil(L, -1));
+				CHECK(lua_isnil(L, -2));
+				lua_pop(L, 2);
+			}
+
+			THEN("the whole message can be converted to tables")
+			{
+				lua->executeCode("tbl = msg:totable() tx = tbl.payload.x");
+				lua_getglobal(L, "tbl");
+				CHECK(lua_istable(L, -1));
+				lua_pop(L, 1);
+				CHECK(lua->readVariable<double>("tx") == 1.5);
+			}
+
+			THEN("its entries can be iterated")
+			{
+				lua_getglobal(L, "msg");
+				REQUIRE(lua_getmetatable(L, -1));
+				lua_getfield(L, -1, "__pairs");
+				lua_replace(L, -2);
+				lua_pushvalue(L, -2);
+				lua_call(L, 1, 3);
+				std::size_t num = 0;
+				while (true)
+				{
+					lua_pushvalue(L, -3);
+					lua_pushvalue(L, -3);
+					lua_pushvalue(L, -3);
+					lua_call(L, 2, 2);
+					if (lua_isnil(L, -2))
+					{
+						lua_pop(L, 2);
+						break;
+					}
+					num++;
+					lua_pop(L, 1);
+					lua_replace(L, -2);
+				}
+				lua_pop(L, 4);
+				CHECK(num == 3);
+			}
+
+			THEN("its entries can be iterated with the pairs method, on any Lua version")
+			{
+				lua->executeCode(
+					"num, list_num, sum = 0, 0, 0 "
+					"for k, v in msg:pairs() do num = num + 1 end "
+					"for i, v in msg.list:pairs() do list_num = list_num + 1 end "
+					"for k, v in msg.payload:pairs() do sum = sum + v end"
+				);
+				CHECK(lua->readVariable<int>("num") == 3);
+				CHECK(lua->readVariable<int>("list_num") == 2);
+				CHECK(lua->readVariable<double>("sum") == 7.5);
+			}
+
+			THEN("keys outside the integer range give nil, and end iteration")
+			{
+				lua->executeCode(
+					"huge = msg[1e20] == nil and msg[-1e300] == nil and msg.list[1e20] == nil "
+					"local f, s = msg:pairs() "
+					"local lf, ls = msg.list:pairs() "
+					"huge_next = f(s, 1e20) == nil and lf(ls, -1e300) == nil"
+				);
+				CHECK(lua->readVariable<bool>("huge"));
+				CHECK(lua->readVariable<bool>("huge_next"));
+			}
+
+			THEN("calling its methods without a proxy raises a Lua error rather than crashing")
+			{
+				CHECK_THROWS_AS(lua->executeCode("msg.totable()"), const LuaContext::ExecutionErrorException&);
+				CHECK_THROWS_AS(lua->executeCode("msg.pairs()"), const LuaContext::ExecutionErrorException&);
+				lua_getglobal(L, "msg");
+				REQUIRE(lua_getmetatable(L, -1));
+				lua_getfield(L, -1, "__len");
+				lua_pushnumber(L, 5);
+				CHECK(lua_pcall(L, 1, 1, 0) != 0);
+				lua_pop(L, 3);
+			}
+		}
+
+		WHEN("we keep only a nested proxy")
+		{
+			lua->executeCode("payload = lqueue:pop_lazy().payload");
+			lua_gc(L, LUA_GCCOLLECT, 0);
+			lua->executeCode("x = payload.x");
+
+			THEN("it keeps the message alive")
+			{
+				CHECK(lua->readVariable<double>("x") == 1.5);
+			}
+		}
+	}
+
+	GIVEN("a queue with a basic message")
+	{
+		using SimpleQueue = Queue<double>;
+		SimpleQueue queue(L, "lqueue");
+		SimpleQueue::Lua lua = queue.lua();
+		queue.push(5.4);
+
+		WHEN("we pop it lazily")
+		{
+			lua->executeCode("msg = lqueue:pop_lazy() empty = lqueue:pop_lazy()");
+
+			THEN("it's converted as usual")
+			{
+				CHECK(lua->readVariable<double>("msg") == 5.4);
+				lua_getglobal(L, "empty");
+				CHECK(lua_isnil(L, -1));
+				lua_pop(L, 1);
+			}
+		}
+	}
+}
+
+
+SCENARIO("Serialised pushes")
+{
+	GIVEN("a queue serialising pushes from C++, and a nested message")
+	{
+		using TapeQueue = BasicQueue<TapePolicy<>, int, double>;
+		TapeQueue queue(L, "lqueue");
+		TapeQueue::Lua lua = queue.lua();
+		const TapeQueue::Item msg = TapeQueue::Map{
+			{ "type", TapeQueue::Str("pose") },
+			{ "id", 7 },
+			{ "payload", TapeQueue::Map{{ "x", 1.5 }, { 1, 2.5 }, { 2, 3.5 }, { -1, 4.5 }} },
+			{ "list", TapeQueue::Vec{ 4.5, TapeQueue::Str(std::string("fi\0ve", 5)) } }
+		};
+
+		WHEN("we encode the message")
+		{
+			Tape tape;
+
+			THEN("plain data is serialised, and anything else isn't")
+			{
+				CHECK(tape.encode(msg));
+				CHECK(!tape.bytes().empty());
+				CHECK(!tape.encode(TapeQueue::Item(TapeQueue::Map{
+					{ "data", TapeQueue::Blob(std::string("bytes")) }
+				})));
+				CHECK(tape.bytes().empty());
+			}
+		}
+
+		WHEN("we push it from C++ and pop it in Lua")
+		{
+			queue.push(msg);
+			lua->executeCode(
+				"m = lqueue:pop() "
+				"t = m.type id = m.id x = m.payload.x a = m.payload[1] b = m.payload[2] "
+				"neg = m.payload[-1] n = #m.list elen = #m.list[2]"
+			);
+
+			THEN("it's decoded to the same tables")
+			{
+				CHECK(lua->readVariable<std::string>("t") == "pose");
+				CHECK(lua->readVariable<int>("id") == 7);
+				CHECK(lua->readVariable<double>("x") == 1.5);
+				CHECK(lua->readVariable<double>("a") == 2.5);
+				CHECK(lua->readVariable<double>("b") == 3.5);
+				CHECK(lua->readVariable<double>("neg") == 4.5);
+				CHECK(lua->readVariable<int>("n") == 2);
+				CHECK(lua->readVariable<int>("elen") == 5);
+			}
+		}
+
+		WHEN("we push it from C++ and pop it in C++")
+		{
+			queue.push(msg);
+			TapeQueue::Msg popped = *queue.pop();
+
+			THEN("it's decoded to the same variant alternatives")
+			{
+				CHECK(popped.get("type").as<TapeQueue::Str>() == "pose");
+				CHECK(popped.get("id").as<int>() == 7);
+				CHECK(popped.get("payload").get("x").as<double>() == 1.5);
+				CHECK(popped.get("payload").get(-1).as<double>() == 4.5);
+				CHECK(popped.get("list").get(1).as<double>() == 4.5);
+				CHECK(popped.get("list").get(2).as<TapeQueue::Str>() == std::string("fi\0ve", 5));
+			}
+		}
+
+		WHEN("we push messages in bulk, including one that isn't plain data")
+		{
+			std::vector<TapeQueue::Item> msgs{
+				msg,
+				TapeQueue::Map{{ "data", TapeQueue::Blob(std::string("bytes")) }},
+				42
+			};
+			queue.push_bulk(std::move(msgs));
+			std::vector<TapeQueue::Msg> popped;
+			queue.drain_into(popped);
+
+			THEN("all are popped as pushed")
+			{
+				REQUIRE(popped.size() == 3);
+				CHECK(popped[0].get("id").as<int>() == 7);
+				CHECK(popped[1].get("data").as<TapeQueue::Blob>().size() == 5);
+				CHECK(popped[2].as<int>() == 42);
+			}
+		}
+
+		WHEN("we push an empty tape")
+		{
+			queue.push(Tape());
+			lua->executeCode("empty = lqueue:pop()");
+			queue.push(Tape());
+			TapeQueue::Msg popped = *queue.pop();
+
+			THEN("Lua pops nil, C++ pops the empty tape, and decoding it throws")
+			{
+				CHECK(lua->executeCode<bool>("return empty == nil"));
+				CHECK(popped.as<Tape>().bytes().empty());
+				CHECK_THROWS_AS(Tape().decode<TapeQueue::Msg>(), const std::out_of_range&);
+			}
+		}
+	}
+
+	GIVEN("queues whose first custom type has no default constructor")
+	{
+		Queue<Handle, double> plain_queue;
+		BasicQueue<TapePolicy<>, Handle, double> tape_queue;
+
+		WHEN("we push and pop numbers and custom types")
+		{
+			plain_queue.push(Handle(3));
+			plain_queue.push(1.5);
+			tape_queue.push(Handle(4));
+			tape_queue.push(2.5);
+
+			THEN("they pop as pushed")
+			{
+				CHECK(plain_queue.pop()->as<Handle>().id == 3);
+				CHECK(plain_queue.pop()->as<double>() == 1.5);
+				CHECK(tape_queue.pop()->as<Handle>().id == 4);
+				CHECK(tape_queue.pop()->as<double>() == 2.5);
+			}
+		}
+	}
+}
+
+
+SCENARIO("Queue statistics")
+{
+	GIVEN("a queue keeping statistics, with a capacity of 3")
+	{
+		using StatsQueue = BasicQueue<StatsPolicy<>, double>;
+		StatsQueue queue(L, "lqueue");
+		StatsQueue::Lua lua = queue.lua();
+		queue.set_capacity(3);
+
+		WHEN("we push from C++ and Lua, overflow it, then pop one")
+		{
+			queue.push(StatsQueue::Map{{ "name", StatsQueue::Str("too long to be inline") }});
+			queue.push(1.5);
+			lua->executeCode("lqueue:push(2.5)");
+			const bool pushed = queue.try_push(3.5);
+			queue.pop();
+			const QueueStats stats = queue.stats();
+
+			THEN("the counts, depths and size estimate reflect it")
+			{
+				CHECK(!pushed);
+				CHECK(stats.pushed == 3);
+				CHECK(stats.popped == 1);
+				CHECK(stats.rejected == 1);
+				CHECK(stats.depth == 2);
+				CHECK(stats.peak_depth == 3);
+				CHECK(stats.bytes >= 2 * sizeof(StatsQueue::Item));
+				CHECK(stats.lock_acquisitions >= 5);
+				CHECK(stats.lock_contentions == 0);
+			}
+
+			THEN("they can be read from Lua")
+			{
+				lua->executeCode("s = lqueue:stats() pushed = s.pushed depth = s.depth");
+				CHECK(lua->readVariable<int>("pushed") == 3);
+				CHECK(lua->readVariable<int>("depth") == 2);
+			}
+
+			THEN("reading them doesn't count towards the lock acquisitions")
+			{
+				CHECK(queue.stats().lock_acquisitions == stats.lock_acquisitions);
+			}
+		}
+
+		WHEN("a pop waits for a message that doesn't come")
+		{
+			queue.pop_for(std::chrono::milliseconds(2));
+			const QueueStats stats = queue.stats();
+
+			THEN("the wait is counted")
+			{
+				CHECK(stats.pop_waits == 1);
+				CHECK(stats.pop_wait_ns >= 1000000);
+			}
+		}
+	}
+
+	GIVEN("dense arrays of each element type")
+	{
+		const Dense doubles(std::vector<double>(100));
+		const Dense floats(std::vector<float>(100));
+		const Dense ints(std::vector<std::int32_t>(100));
+
+		THEN("their size is estimated from their element size")
+		{
+			CHECK(estimate_bytes(doubles) == 800);
+			CHECK(estimate_bytes(floats) == 400);
+			CHECK(estimate_bytes(ints) == 400);
+		}
+	}
+
+	GIVEN("a ring buffer queue keeping statistics, and a queue that doesn't")
+	{
+		BasicQueue<StatsPolicy<RingPolicy<8>>, double> ring_queue;
+		Queue<double> plain_queue;
+		ring_queue.push_bulk(std::vector<Queue<double>::Item>{ 1.5, 2.5 });
+		plain_queue.push(1.5);
+
+		THEN("the ring buffer counts all but lock statistics, and the other only its depth")
+		{
+			CHECK(ring_queue.stats().pushed == 2);
+			CHECK(ring_queue.stats().lock_acquisitions == 0);
+			CHECK(plain_queue.stats().depth == 1);
+			CHECK(plain_queue.stats().pushed == 0);
+		}
+	}
+}
+
+
+SCENARIO("Push-to-pop latency")
+{
+	GIVEN("a latency histogram")
+	{
+		LatencyHistogram histogram;
+		for (int i = 1; i <= 1000; i++)
+			histogram.record(i * 1000.0);
+
+		THEN("percentiles are within the bucket precision")
+		{
+			CHECK(histogram.count() == 1000);
+			CHECK(histogram.percentile(50) >= 500000);
+			CHECK(histogram.percentile(50) <= 500000 * 1.04);
+			CHECK(histogram.percentile(99) >= 990000);
+			CHECK(histogram.percentile(99) <= 990000 * 1.04);
+			CHECK(histogram.percentile(100) == 1000000);
+			CHECK(histogram.max() == 1000000);
+		}
+
+		WHEN("we reset it")
+		{
+			histogram.reset();
+
+			THEN("it is empty")
+			{
+				CHECK(histogram.count() == 0);
+				CHECK(histogram.percentile(50) == 0);
+			}
+		}
+	}
+
+	GIVEN("a queue timestamping pushes, with messages queued for 2ms")
+	{
+		using LatencyQueue = BasicQueue<LatencyPolicy<>, double>;
+		LatencyQueue queue(L, "lqueue");
+		LatencyQueue::Lua lua = queue.lua();
+		queue.push(LatencyQueue::Map{{ "x", 1.5 }});
+		queue.push_bulk(std::vector<LatencyQueue::Item>{ 2.5, 3.5, 4.5 });
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+
+		WHEN("we pop them in C++ and Lua")
+		{
+			const double x = queue.pop()->get("x").as<double>();
+			lua->executeCode("y = lqueue:pop() rest = lqueue:drain() p = lqueue:latency(50)");
+
+			THEN("the messages are unchanged, and their latencies recorded")
+			{
+				CHECK(x == 1.5);
+				CHECK(lua->readVariable<double>("y") == 2.5);
+				CHECK(lua->readVariable<double>("p") >= 2e6);
+				CHECK(queue.latency().count() == 4);
+				CHECK(queue.latency().percentile(0) >= 2000000);
+				CHECK(queue.latency().max() < 10000000000u);
+			}
+
+			THEN("the latencies can be reset from Lua")
+			{
+				lua->executeCode("lqueue:reset_latency()");
+				CHECK(queue.latency().count() == 0);
+			}
+		}
+	}
+
+	GIVEN("a bounded ring buffer queue timestamping with a coarse clock, and a queue that doesn't")
+	{
+		BasicQueue<LatencyPolicy<RingPolicy<8>, CoarseClock>, double> ring_queue;
+		Queue<double> plain_queue;
+		ring_queue.push(1.5);
+		plain_queue.push(1.5);
+		ring_queue.pop();
+		plain_queue.pop();
+
+		THEN("only the former records latencies")
+		{
+			CHECK(ring_queue.latency().count() == 1);
+			CHECK(plain_queue.latency().count() == 0);
+		}
+	}
+}
+
+
+SCENARIO("Readiness descriptor")
+{
+	using SimpleQueue = Queue<double>;
+
+	GIVEN("a queue with a readiness descriptor")
+	{
+		SimpleQueue queue(L, "lqueue");
+		SimpleQueue::Lua lua = queue.lua();
+		const int fd = queue.ready_fd();
+
+		THEN("it is the same descriptor each time, in C++ and Lua, and not readable")
+		{
+			lua->executeCode("fd = lqueue:ready_fd()");
+			CHECK(fd >= 0);
+			CHECK(queue.ready_fd() == fd);
+			CHECK(lua->readVariable<int>("fd") == fd);
+			CHECK(!readable(fd));
+		}
+
+		WHEN("we push a burst of messages")
+		{
+			queue.push(1.5);
+			queue.push(2.5);
+			queue.push_bulk(std::vector<SimpleQueue::Item>{ 3.5, 4.5 });
+
+			THEN("it is readable, having been written to once")
+			{
+				REQUIRE(readable(fd));
+				std::uint64_t writes = 0;
+				CHECK(read(fd, &writes, sizeof(writes)) == sizeof(writes));
+				CHECK(writes == 1);
+			}
+
+			AND_WHEN("we pop some of them")
+			{
+				queue.pop();
+				lua->executeCode("lqueue:pop()");
+
+				THEN("it is still readable")
+				{
+					CHECK(readable(fd));
+				}
+
+				AND_WHEN("we pop the rest")
+				{
+					lua->executeCode("lqueue:pop_many(2)");
+
+					THEN("it is no longer readable")
+					{
+						CHECK(!readable(fd));
+					}
+
+					AND_WHEN("we push again")
+					{
+						queue.push(5.5);
+
+						THEN("it is readable again")
+						{
+							CHECK(readable(fd));
+						}
+					}
+				}
+			}
+		}
+	}
+
+	GIVEN("a non-empty queue")
+	{
+		SimpleQueue queue;
+		queue.push(1.5);
+
+		THEN("its readiness descriptor is readable as soon as it is created")
+		{
+			CHECK(readable(queue.ready_fd()));
+		}
+	}
+
+	GIVEN("a consumer sleeping in poll on the descriptor")
+	{
+		SimpleQueue queue;
+		const int fd = queue.ready_fd();
+		std::atomic<double> received{0};
+		std::thread consumer([&]() {
+			pollfd pfd{ fd, POLLIN, 0 };
+			poll(&pfd, 1, 5000);
+			received = queue.pop()->as<double>();
+		});
+
+		WHEN("a producer pushes")
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			queue.push(7.5);
+			consumer.join();
+
+			THEN("the consumer wakes and pops the message")
+			{
+				CHECK(received == 7.5);
+				CHECK(!readable(fd));
+			}
+		}
+	}
+}
+
+
+SCENARIO("Receiving in coroutines")
+{
+	using SimpleQueue = Queue<double>;
+
+	GIVEN("a queue and a coroutine scheduler")
+	{
+		SimpleQueue queue(L, "lqueue");
+		SimpleQueue::Lua lua = queue.lua();
+		Scheduler scheduler(L);
+
+		WHEN("we look recv up on the queue")
+		{
+			lua_getglobal(L, "lqueue");
+			lua_getfield(L, -1, "recv");
+			const bool found = lua_isfunction(L, -1);
+			lua_pop(L, 2);
+
+			THEN("luawrapper finds it among the queue's methods")
+			{
+				CHECK(found);
+			}
+		}
+
+		WHEN("we receive outside a coroutine")
+		{
+			queue.push(1.5);
+			lua->executeCode("first = lqueue:recv() second = lqueue:recv()");
+
+			THEN("it pops without waiting")
+			{
+				CHECK(lua->readVariable<double>("first") == 1.5);
+				CHECK(lua->executeCode<bool>("return second == nil"));
+			}
+		}
+
+		WHEN("a coroutine receives from the empty queue")
+		{
+			lua->executeCode("received = {}");
+			scheduler.spawn("for i = 1, 2 do received[i] = lqueue:recv() end");
+
+			THEN("it waits")
+			{
+				CHECK(scheduler.size() == 1);
+				CHECK(scheduler.run_for(std::chrono::milliseconds(1)) == 1);
+				CHECK(lua->executeCode<int>("return #received") == 0);
+			}
+
+			AND_WHEN("a producer thread pushes")
+			{
+				std::thread producer([&queue]() {
+					std::this_thread::sleep_for(std::chrono::milliseconds(5));
+					queue.push(1.5);
+					queue.push(2.5);
+				});
+				scheduler.run();
+				producer.join();
+
+				THEN("the coroutine is resumed and receives the messages in order")
+				{
+					CHECK(scheduler.size() == 0);
+					CHECK(lua->executeCode<double>("return received[1]") == 1.5);
+					CHECK(lua->executeCode<double>("return received[2]") == 2.5);
+				}
+			}
+		}
+	}
+
+	GIVEN("coroutines waiting on two different queues")
+	{
+		SimpleQueue first(L, "first_queue");
+		SimpleQueue second(L, "second_queue");
+		SimpleQueue::Lua lua = first.lua();
+		Scheduler scheduler(L);
+		lua->executeCode("first_got = 0 second_got = 0");
+		scheduler.spawn("while true do first_got = first_got + first_queue:recv() end");
+		scheduler.spawn("while true do second_got = second_got + second_queue:recv() end");
+
+		WHEN("we push to one of them")
+		{
+			second.push(2.5);
+			second.push(3.5);
+			scheduler.run_for(std::chrono::milliseconds(100));
+
+			THEN("only its coroutine is resumed, and both wait again")
+			{
+				CHECK(lua->readVariable<double>("first_got") == 0);
+				CHECK(lua->readVariable<double>("second_got") == 6);
+				CHECK(scheduler.size() == 2);
+				CHECK(second.size() == 0);
+			}
+		}
+	}
+
+	GIVEN("a coroutine that fails after receiving")
+	{
+		SimpleQueue queue(L, "lqueue");
+		Scheduler scheduler(L);
+		scheduler.spawn("lqueue:recv() error('failed')");
+		queue.push(1.5);
+
+		THEN("running it throws, and discards it")
+		{
+			CHECK_THROWS_AS(scheduler.run_for(std::chrono::milliseconds(100)),
+				const LuaContext::ExecutionErrorException&);
+			CHECK(scheduler.size() == 0);
+		}
+	}
+}
+
+
+SCENARIO("Lock-free ring buffer storage")
+{
+	GIVEN("a ring buffer with 4 slots")
+	{
+		RingStorage<int, 4> ring;
+
+		THEN("the ring buffer is initially empty")
+		{
+			CHECK(ring.size() == 0);
+			CHECK(!ring.try_pop());
+		}
+
+		WHEN("we fill the ring buffer")
+		{
+			for (int i = 0; i < 4; i++)
+				CHECK(ring.try_push(int(i)));
+
+			THEN("the size is 4")
+			{
+				CHECK(ring.size() == 4);
+			}
+
+			THEN("further pushes fail")
+			{
+				CHECK(!ring.try_push(4));
+			}
+
+			AND_WHEN("we pop from the ring buffer")
+			{
+				THEN("the elements come out in order, wrapping around as we push more")
+				{
+					CHECK(*ring.try_pop() == 0);
+					CHECK(*ring.try_pop() == 1);
+					CHECK(ring.try_push(4));
+					CHECK(ring.try_push(5));
+					CHECK(!ring.try_push(6));
+					CHECK(*ring.try_pop() == 2);
+					CHECK(*ring.try_pop() == 3);
+					CHECK(*ring.try_pop() == 4);
+					CHECK(*ring.try_pop() == 5);
+					CHECK(!ring.try_pop());
+				}
+			}
+		}
+	}
+
+	GIVEN("a small ring buffer queue with C++ producers and consumers")
+	{
+		using RingQueue = BasicQueue<RingPolicy<16>, double>;
+		RingQueue queue(L, "lqueue");
+
+		std::atomic<unsigned> num_popped{0};
+
+		auto producer = [&queue]() {
+			for (unsigned i = 0; i < 1000; i++)
+				queue.push(RingQueue::Map{{"value", double(i)}});
+		};
+
+		auto consumer = [&queue, &num_popped]() {
+			while (num_popped < 5000)
+				if (RingQueue::Opt msg = queue.pop())
+					num_popped++;
+				else
+					std::this_thread::yield();
+		};
+
+		WHEN("we run the threads to completion")
+		{
+			std::array<std::thread, 5> producers;
+			std::array<std::thread, 3> consumers;
+
+			for (std::thread& t : producers)
+				t = std::thread(producer);
+			for (std::thread& t : consumers)
+				t = std::thread(consumer);
+			for (std::thread& t : producers)
+				t.join();
+			for (std::thread& t : consumers)
+				t.join();
+
+			THEN("every message pushed was popped exactly once")
+			{
+				CHECK(num_popped == 5000);
+				CHECK(queue.size() == 0);
+			}
+		}
+
+		WHEN("we push and pop from Lua")
+		{
+			queue.lua()->executeCode(
+				"lqueue:push({type=\"FROM LUA\"})\n"
+				"item = lqueue:pop()\n"
+				"type = item.type"
+			);
+
+			THEN("the message is correct")
+			{
+				CHECK(queue.lua()->readVariable<RingQueue::Str>("type") == "FROM LUA");
+			}
+		}
+	}
+}
+
+
+struct CustomType
+{
+	CustomType()
+	{
+		vals = nullptr;
+	}
+	CustomType(const CustomType& other_)
+	{
+		val = other_.val;
+		vals = new int[1];
+		vals[0] = other_.vals[0];
+	}
+	CustomType(CustomType&& other_)
+	{
+		val = other_.val;
+		vals = other_.vals;
+		other_.vals = nullptr;
+	}
+
+	CustomType& operator=(const CustomType& other_)
+	{
+		val = other_.val;
+		vals = other_.vals;
+	}
+
+	CustomType(int val_) : val(val_)
+	{
+		vals = new int[1];
+		vals[0] = val_;
+	}
+	~CustomType()
+	{
+		delete[] vals;
+	}
+	int val;
+	int* vals;
+};
+
+
+SCENARIO("Custom types")
+{
+	GIVEN("a queue with messages allowing a custom type")
+	{
+		using ExQueue = Queue<CustomType>;
+		ExQueue queue(L, "lqueue");
+		ExQueue::Lua lua = queue.lua();
+		lua->registerMember("val", &CustomType::val);
+
+		WHEN("we push and pop in C++")
+		{
+			queue.push(CustomType(3));
+			ExQueue::Msg msg = *queue.pop();
+
+			THEN("the value is correct")
+			{
+				CHECK(msg.as<CustomType>().val == 3);
+			}
+		}
+
+		WHEN("we push and pop in Lua")
+		{
+			CustomType custom(7);
+
+			lua->writeVariable("lcustom", custom);
+			lua->executeCode(
+				"val_before = lcustom.val\n"
+				"lqueue:push(lcustom)\n"
+				"lcustom_popped = lqueue:pop()\n"
+				"val_after = lcustom_popped.val\n"
+			);
+
+			THEN("the value is correct")
+			{
+				int val_before = lua->readVariable<int>("val_before");
+				int val_after = lua->readVariable<int>("val_after");
+
+				CHECK(val_before == 7);
+				CHECK(val_after == 7);
+			}
+		}
+
+		WHEN("we push in C++ and pop in Lua")
+		{
+			queue.push(CustomType(5));
+
+			lua->executeCode(
+				"lcustom_popped = lqueue:pop()\n"
+				"val = lcustom_popped.val\n"
+			);
+
+			THEN("the value is correct")
+			{
+				int val = lua->readVariable<int>("val");
+
+				CHECK(val == 5);
+			}
+		}
+
+		WHEN("we push a table of custom types, strings and numbers in Lua and pop in C++")
+		{
+			lua->writeFunction("LCustom", [](int v) {
+				return CustomType(v);
+			});
+
+			lua->executeCode("lqueue:push({custom=LCustom(4), nested={str=\"a string\", num=3}})");
+
+			THEN("each value is read as the matching alternative")
+			{
+				ExQueue::Msg msg = *queue.pop();
+
+				CHECK(msg.get("custom").as<CustomType>().val == 4);
+				CHECK(msg.get("nested").get("str").as<ExQueue::Str>() == "a string");
+				// With no numeric alternative, numbers are converted to strings.
+				CHECK(msg.get("nested").get("num").as<ExQueue::Str>() == "3");
 			}
 		}
 